@@ -16,23 +16,111 @@
 /*
  * Declare extern/global variables
  */
-extern void *sys_call_table[];
 struct file *filePtr;
 uid_t userEuid;
-int Block_Size;
+int Block_Size;		/* Default chunk size of a watch */
+struct head_node *watch_hash[1 << _WATCH_HASH_BITS_];
 
+/*
+ * Slab caches for the nodes, so that their footprint shows up
+ * separately in /proc/slabinfo
+ */
+struct kmem_cache *data_cache;
+struct kmem_cache *head_cache;
 
 /*
- * Bit operations to handle bitmap
- * http://stackoverflow.com/questions/47981/how-do-you-set-clear-and-toggle-a-single-bit-in-c
- *
+ * kwatch_mutex serialises every change to the watches and their data
+ * Hooks never take it: they only walk watch_hash under RCU and queue
+ * their changes in the stage ring of their CPU, merge_work merges
+ * them
  */
-void join_bits(int *bMap1, int *bMap2)
-{
-	int i = 0;
-	for (i = 0; i < 4; i++)
-		bMap1[i] |= bMap2[i];
-}
+DEFINE_MUTEX(kwatch_mutex);
+DEFINE_PER_CPU(struct stage_ring, stage_rings);
+struct stage_rec merge_buf[_STAGE_LEN_];
+unsigned char rec_buf[_REC_MAX_];
+char path_buf[_PATH_MAX_];
+DECLARE_WORK(merge_work, merge_work_fn);
+atomic_t stage_drops = ATOMIC_INIT(0);
+
+/*
+ * Change sets taken off their watch, chained through next, waiting for
+ * reap_work to free them, see retire_changes()
+ */
+struct head_node *reap_list;
+DEFINE_SPINLOCK(reap_lock);
+DECLARE_WORK(reap_work, reap_work_fn);
+
+/*
+ * Cached result of the parent walk, per CPU and per dentry
+ * watch_gen is bumped whenever a cached result may have gone stale
+ */
+DEFINE_PER_CPU(struct verdict_cache, verdict_caches);
+atomic_t watch_gen = ATOMIC_INIT(0);
+
+/*
+ * Negative fast path: number of watches, and the superblocks they
+ * live on. Updated under kwatch_mutex, read locklessly by the hooks
+ */
+atomic_t num_watches = ATOMIC_INIT(0);
+struct sb_watch sb_watches[_SB_WATCH_MAX_];
+int sb_watch_overflow;
+
+/*
+ * Shared writable mappings of watched files, see add_mmap_watch()
+ * mmap_prune_work forgets the ones no longer in use, see
+ * mmap_prune_fn()
+ */
+struct mmap_watch mmap_watches[1 << _MMAP_WATCH_BITS_];
+DEFINE_SPINLOCK(mmap_watch_lock);
+atomic_t num_mmaps = ATOMIC_INIT(0);
+DECLARE_DELAYED_WORK(mmap_prune_work, mmap_prune_fn);
+
+/*
+ * Writes in progress, see write_entry(), and io_uring writes waiting
+ * for their completion, see add_async_write(). io_complete_hooked
+ * counts the completions of io_uring hooked, io_write() is only
+ * followed once both are
+ */
+struct write_slot write_slots[1 << _WRITE_SLOT_BITS_];
+struct async_write async_writes[1 << _ASYNC_WRITE_BITS_];
+DEFINE_SPINLOCK(async_write_lock);
+atomic_t num_async_writes = ATOMIC_INIT(0);
+int io_complete_hooked;
+
+/*
+ * Hook statistics, see stat_entry()
+ * cur_hook is the probe whose handler runs on this CPU, -1 if none
+ * The record counters are only touched by the merge
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 3, 0)
+DEFINE_STATIC_KEY_FALSE(kwatch_stats_key);
+#else
+int kwatch_stats_flag;
+#endif
+DEFINE_PER_CPU(struct hook_stats, hook_stats[_MAX_HOOKS_]);
+DEFINE_PER_CPU(unsigned long, setattr_kinds[_SETATTR_KINDS_]);
+DEFINE_PER_CPU(int, cur_hook) = -1;
+kretprobe_handler_t hook_entry[_MAX_HOOKS_];
+kretprobe_handler_t hook_ret[_MAX_HOOKS_];
+DECLARE_BITMAP(probes_hooked, _MAX_HOOKS_);
+unsigned long probes_missed;
+unsigned long records_created;
+unsigned long records_merged;
+struct dentry *stats_dir;
+
+/*
+ * /proc/kwatch, which holds a file per watch, see add_watch_proc()
+ */
+struct proc_dir_entry *proc_dir;
+
+/*
+ * Open files of /dev/kwatch, see feed_open()
+ * feeds is changed and walked under kwatch_mutex, num_feeds counts
+ * the subscribed ones and lets the hooks know whether to merge right
+ * away
+ */
+LIST_HEAD(feeds);
+atomic_t num_feeds = ATOMIC_INIT(0);
 
 
 /*
@@ -94,38 +182,15 @@ OUT:
  */
 char *my_get_from_user(const char * const dirname)
 {
-	int ret = 0;
 	char *ret_val = NULL;
-	int ipLen = 0;
 
 	/*
-	 * Verify if we have access to
-	 * the pointers
+	 * Checks the pointer, and fails on paths
+	 * longer than PATH_MAX
 	 */
-	ret = access_ok(VERIFY_READ, dirname, 0);
-	if (!ret) {
-		ret = -EFAULT;
-		goto OUT;
-	}
-
-	ipLen = strlen_user(dirname);
-	ret_val = kmalloc(ipLen, GFP_KERNEL);
-	if (NULL == ret_val) {
-		ret = -ENOMEM;
-		goto OUT;
-	} else {
-		ret = strncpy_from_user(ret_val, dirname, ipLen);
-		if (ret < 0) {
-			goto OUT;
-		}
-	}
-
-OUT:
-	if (ret < 0) {
-		if (ret_val) {
-			kfree(ret_val);
-			ret_val = NULL;
-		}
+	ret_val = strndup_user(dirname, PATH_MAX);
+	if (IS_ERR(ret_val)) {
+		ret_val = NULL;
 	}
 
 	return ret_val;
@@ -165,1109 +230,4374 @@ void myprintf(char *frmt, ...)
 */
 
 /*
- * Function that takes in a file desc
- * And checks recursively if any of its parent
- * is under watch
- * Also takes the int bMap which specifies what changes
- * were made
+ * Cheap checks telling that a file can not be under any watch:
+ * it is neither a regular file nor a directory, or no watch is set
+ * on its file system. The parent walk never crosses a mount point,
+ * so the latter is exact
+ * 1 - has to be filtered
+ * 0 - Do not filter
  */
-void process_file_desc(unsigned int fd, int *bMap)
+int file_filter(struct file *filePtr)
 {
-	unsigned long parentInodeNo;
-	struct file *curFile = NULL;
-	char *path = NULL;
-	char *path_buf = NULL;
+	return dentry_filter(filePtr->f_path.dentry);
+}
 
-	if (fd < 3) {
-		goto OUT;
+int dentry_filter(struct dentry *dentry)
+{
+	struct inode *inode = dentry->d_inode;
+
+	if (inode == NULL) {
+		return 1;
 	}
 
-	curFile = fget(fd);
-	if (!curFile) {
-		curFile = NULL;
-		goto OUT;
+	if (!(S_ISREG(inode->i_mode) || S_ISDIR(inode->i_mode))) {
+		return 1;
 	}
 
-	path_buf = kmalloc(_MAX_PATH_LEN_, GFP_KERNEL);
-	if (path_buf == NULL) {
-		goto OUT;
+	return !sb_has_watches(inode->i_sb->s_dev);
+}
+
+/*
+ * Check if any watch is set on the file system dev
+ * Lockless, a racing set/rem watch may be seen late
+ */
+int sb_has_watches(dev_t dev)
+{
+	int i;
+
+	if (READ_ONCE(sb_watch_overflow)) {
+		return 1;
+	}
+
+	for (i = 0; i < _SB_WATCH_MAX_; i++) {
+		if (READ_ONCE(sb_watches[i].count)
+				&& READ_ONCE(sb_watches[i].dev) == dev) {
+			return 1;
+		}
 	}
-	path = dentry_path_raw(curFile->f_path.dentry, path_buf,
-							_MAX_PATH_LEN_);
-	if (NULL != path) {
-		if (path_filter(path)) {
+
+	return 0;
+}
+
+/*
+ * Account a watch on the file system dev
+ * If every slot is in use we stop filtering on file systems
+ * Caller holds kwatch_mutex
+ */
+void add_sb_watch(dev_t dev)
+{
+	int i, free = -1;
+
+	for (i = 0; i < _SB_WATCH_MAX_; i++) {
+		if (sb_watches[i].count && sb_watches[i].dev == dev) {
+			WRITE_ONCE(sb_watches[i].count,
+					sb_watches[i].count + 1);
 			goto OUT;
 		}
+
+		if (!sb_watches[i].count && free < 0) {
+			free = i;
+		}
 	}
 
-	parentInodeNo = check_if_any_parent_is_watched_filp(curFile);
-	if (parentInodeNo > 0) {
-		add_data_to_obj(parentInodeNo,
-					curFile->f_path.dentry->d_inode->i_ino,
-					bMap);
+	if (free < 0) {
+		WRITE_ONCE(sb_watch_overflow, sb_watch_overflow + 1);
+		goto OUT;
 	}
 
+	WRITE_ONCE(sb_watches[free].dev, dev);
+	smp_wmb();
+	WRITE_ONCE(sb_watches[free].count, 1);
+
 OUT:
-	if (curFile) {
-		fput(curFile);
-		curFile = NULL;
-	}
+	atomic_inc(&num_watches);
+}
 
-	if (path_buf) {
-		kfree(path_buf);
-		path_buf = NULL;
+/*
+ * Undo add_sb_watch()
+ * Caller holds kwatch_mutex
+ */
+void rem_sb_watch(dev_t dev)
+{
+	int i;
+
+	atomic_dec(&num_watches);
+
+	for (i = 0; i < _SB_WATCH_MAX_; i++) {
+		if (sb_watches[i].count && sb_watches[i].dev == dev) {
+			WRITE_ONCE(sb_watches[i].count,
+					sb_watches[i].count - 1);
+			return;
+		}
 	}
+
+	WRITE_ONCE(sb_watch_overflow, sb_watch_overflow - 1);
 }
 
 /*
- * Function similar to process_file_desc
- * but takes a filename (kernel space)
- * as arg
+ * Remember a shared writable mapping of the file key under watch
+ * Called from the mmap hook, so it can not sleep: slots are only ever
+ * filled under mmap_watch_lock, and emptied under kwatch_mutex too
+ * Returns -ENOSPC if no slot is left for it
  */
-void process_file_name(const char __user *filename, int *bMap)
+int add_mmap_watch(struct file *file, const struct kwatch_key *key,
+			const struct kwatch_key *watch)
 {
-	int ret;
-	unsigned long fileInodeNo = 0, parentInodeNo = 0;
-	char *kern_filename = NULL;
+	struct address_space *mapping = file->f_mapping;
+	struct mmap_watch *ent;
+	struct inode *inode;
+	unsigned long bucket;
+	int errno = 0;
+	int i, free = -1;
 
-	kern_filename = my_get_from_user(filename);
-	if (NULL == kern_filename) {
-		goto OUT;
+	bucket = hash_ptr(mapping, _MMAP_WATCH_BITS_);
+
+	spin_lock(&mmap_watch_lock);
+	for (i = 0; i < _MMAP_PROBE_; i++) {
+		ent = &mmap_watches[(bucket + i) &
+				((1 << _MMAP_WATCH_BITS_) - 1)];
+		if (ent->mapping == mapping) {
+			goto OUT;
+		}
+
+		if (ent->mapping == NULL && free < 0) {
+			free = (bucket + i) & ((1 << _MMAP_WATCH_BITS_) - 1);
+		}
 	}
 
-	if (path_filter(kern_filename)) {
+	if (free < 0) {
+		errno = -ENOSPC;
 		goto OUT;
 	}
-	ret = get_inode(kern_filename, &fileInodeNo);
-	if (ret < 0) {
+
+	inode = igrab(mapping->host);
+	if (inode == NULL) {
+		errno = -ENOENT;
 		goto OUT;
 	}
 
-	parentInodeNo = check_if_any_parent_is_watched(kern_filename);
-	if (parentInodeNo > 0) {
-		add_data_to_obj(parentInodeNo, fileInodeNo, bMap);
-	}
+	ent = &mmap_watches[free];
+	WRITE_ONCE(ent->seq, ent->seq + 1);
+	smp_wmb();
+	ent->inode = inode;
+	ent->mnt = mntget(file->f_path.mnt);
+	ent->key = *key;
+	ent->watch = *watch;
+	WRITE_ONCE(ent->mapping, mapping);
+	smp_wmb();
+	WRITE_ONCE(ent->seq, ent->seq + 1);
+	atomic_inc(&num_mmaps);
+	schedule_delayed_work(&mmap_prune_work, _MMAP_PRUNE_DELAY_);
 
 OUT:
-	if (kern_filename) {
-		kfree(kern_filename);
-		kern_filename = NULL;
-	}
+	spin_unlock(&mmap_watch_lock);
+	return errno;
 }
 
 /*
- * Function to check if an inode is currently being tracked
- * Returns 1 if true, 0 if false
+ * Find the file and watch of a mapping
+ * Lockless, as pages are dirtied everywhere: the slot is read again if
+ * it was filled or emptied while we copied it, as told by its seq. One
+ * being filled or emptied right now is skipped, we may be interrupting
+ * its writer: no page of a mapping is dirtied before it is added, nor
+ * do its changes matter once it is removed
+ * 1 - found
+ * 0 - not a mapping we track
  */
-int is_stat(unsigned long inode)
+int find_mmap_watch(struct address_space *mapping, struct kwatch_key *key,
+			struct kwatch_key *watch)
 {
-	struct head_node *temp;
-	int found = 0;
-	temp = main_obj->next;
+	struct mmap_watch *ent;
+	unsigned long bucket;
+	unsigned int seq;
+	int i;
 
-	while (temp != NULL) {
-		if (temp->inode == inode) {
-			found = 1;
-			break;
+	bucket = hash_ptr(mapping, _MMAP_WATCH_BITS_);
+
+	for (i = 0; i < _MMAP_PROBE_; i++) {
+		ent = &mmap_watches[(bucket + i) &
+				((1 << _MMAP_WATCH_BITS_) - 1)];
+RETRY:
+		seq = READ_ONCE(ent->seq);
+		smp_rmb();
+		if ((seq & 1) || READ_ONCE(ent->mapping) != mapping) {
+			continue;
+		}
+
+		*key = ent->key;
+		*watch = ent->watch;
+		smp_rmb();
+		if (READ_ONCE(ent->seq) != seq) {
+			goto RETRY;
 		}
 
-		temp = temp->next;
+		return 1;
 	}
 
-	return found;
+	return 0;
 }
 
 /*
- * Function to add inode info under a watched directory's inode
- * This is to be added to the chain of data connected to a head
- * Also takes a bitmap. If the data is already present,
- * ORs the bitmap to represent the full changes
+ * Go through the mappings of the files under watch, or of all of them
+ * if watch is NULL. Mappings no longer in use are forgotten, those
+ * still in use are kept, unless mode is _MMAP_FORGET_
+ * With _MMAP_FLUSH_ the ones kept have their dirty pages written back:
+ * writeback write protects the pages again, so that the next write to
+ * them is seen even though it was dirty. It is done before the changes
+ * are flushed, so that a write landing in between is recorded
+ * The slots are emptied under kwatch_mutex, _MMAP_BATCH_ at a time,
+ * while writeback and putting the files, which may sleep on I/O, are
+ * done once it is dropped
+ * Caller does not hold kwatch_mutex
  */
-void add_data_to_obj(unsigned long head, unsigned long data, int *bMap)
+void sync_mmap_watches(const struct kwatch_key *watch, int mode)
 {
-	struct head_node *temp1;
-	struct data_node *temp2, *temp3, *new_node;
-	int ret = -1;
-	int i = 0;
-	temp1 = main_obj->next;
+	struct mmap_watch *ent;
+	struct inode *inode[_MMAP_BATCH_];
+	struct vfsmount *mnt[_MMAP_BATCH_];
+	int i = 0, j, n;
+
+	while (i < (1 << _MMAP_WATCH_BITS_)) {
+		n = 0;
+		mutex_lock(&kwatch_mutex);
+		for (; i < (1 << _MMAP_WATCH_BITS_) && n < _MMAP_BATCH_; i++) {
+			ent = &mmap_watches[i];
+			if (ent->mapping == NULL) {
+				continue;
+			}
 
-	new_node = kmalloc(sizeof(struct data_node), GFP_KERNEL);
-	if (new_node == NULL) {
-		ret = -ENOMEM;
-		goto OUT;
-	}
+			if (watch != NULL && !key_equal(&ent->watch, watch)) {
+				continue;
+			}
 
-	new_node->inode = data;
-	new_node->next = NULL;
+			if (mode != _MMAP_FORGET_ && ent->inode->i_nlink
+					&& mapping_mapped(ent->mapping)) {
+				if (mode != _MMAP_FLUSH_) {
+					continue;
+				}
 
-	for (i = 0; i < 4; i++)
-		(new_node->bMap)[i] = bMap[i];
+				/* A reference of our own, the slot may go */
+				inode[n] = igrab(ent->inode);
+				if (inode[n] != NULL) {
+					mnt[n++] = NULL;
+				}
 
-	while (temp1 != NULL) {
-		if (temp1->inode == head) {
-			if (temp1->data == NULL) {
-				temp1->data = new_node;
-				temp1->num_data = 1;
-				ret = 0;
-				goto OUT;
-			} else {
-				temp2 = temp1->data;
-				temp3 = temp2;
+				continue;
+			}
 
-				while (temp2 != NULL) {
-					if (temp2->inode == data) {
-						join_bits(temp2->bMap, bMap);
-						goto OUT;
-					}
+			inode[n] = ent->inode;
+			mnt[n++] = ent->mnt;
 
-					temp3 = temp2;
-					temp2 = temp2->next;
-				}
+			spin_lock(&mmap_watch_lock);
+			WRITE_ONCE(ent->seq, ent->seq + 1);
+			smp_wmb();
+			WRITE_ONCE(ent->mapping, NULL);
+			ent->inode = NULL;
+			ent->mnt = NULL;
+			smp_wmb();
+			WRITE_ONCE(ent->seq, ent->seq + 1);
+			spin_unlock(&mmap_watch_lock);
 
-				temp3->next = new_node;
-				temp1->num_data++;
-				ret = 0;
-				goto OUT;
+			atomic_dec(&num_mmaps);
+		}
+		mutex_unlock(&kwatch_mutex);
+
+		for (j = 0; j < n; j++) {
+			if (mnt[j] == NULL) {
+				filemap_fdatawrite(inode[j]->i_mapping);
+			}
+
+			iput(inode[j]);
+			if (mnt[j] != NULL) {
+				mntput(mnt[j]);
 			}
-		} else {
-			temp1 = temp1->next;
 		}
 	}
+}
 
-OUT:
-	if (ret < 0) {
-		if (new_node) {
-			kfree(new_node);
-			new_node = NULL;
-		}
+/*
+ * A slot holds its file system mounted: forget the mappings no longer
+ * in use every _MMAP_PRUNE_DELAY_, so that it can be unmounted once
+ * they are unmapped, without waiting for their watch to be flushed
+ */
+void mmap_prune_fn(struct work_struct *work)
+{
+	sync_mmap_watches(NULL, _MMAP_PRUNE_);
+
+	if (atomic_read(&num_mmaps)) {
+		schedule_delayed_work(&mmap_prune_work, _MMAP_PRUNE_DELAY_);
 	}
+}
 
-	return;
+/*
+ * Fill the key identifying an inode
+ */
+void fill_key(struct inode *inode, struct kwatch_key *key)
+{
+	key->ino = inode->i_ino;
+	key->dev = inode->i_sb->s_dev;
+	key->gen = inode->i_generation;
 }
 
+int key_equal(const struct kwatch_key *key1, const struct kwatch_key *key2)
+{
+	return key1->ino == key2->ino && key1->dev == key2->dev
+				&& key1->gen == key2->gen;
+}
 
 /*
- * Insert a new head object in the watch structure
- * This just adds an entry to the main ds
- * Changes will be added later to this heads data nodes
+ * Bucket of a key in a hash of 2^bits buckets
+ * dev and gen are folded into one word first, so that equal inode
+ * numbers on different file systems spread over different buckets
  */
-int insert_obj(struct head_node *head)
+unsigned long hash_key(const struct kwatch_key *key, unsigned int bits)
 {
-	struct head_node *temp1, *temp2;
-	int ret = -1;
-	temp1 = main_obj->next;
-	temp2 = main_obj;
+	return hash_long(key->ino ^ hash_32(key->dev ^ hash_32(key->gen, 32),
+						32), bits);
+}
 
-	while (temp1 != NULL) {
-		if (temp1->inode == head->inode) {
-			goto OUT;
-		}
+/*
+ * Function to check if an inode is currently being tracked
+ * Returns its head if true, NULL if false
+ * Caller holds either rcu_read_lock() or kwatch_mutex
+ */
+struct head_node *is_stat(const struct kwatch_key *key)
+{
+	struct head_node *temp;
 
-		temp2 = temp1;
-		temp1 = temp1->next;
-	}
+	temp = rcu_dereference_check(
+			watch_hash[hash_key(key, _WATCH_HASH_BITS_)],
+			lockdep_is_held(&kwatch_mutex));
+	while (temp != NULL) {
+		if (key_equal(&temp->key, key))
+			break;
 
-	temp2->next = head;
-	ret = 0;
+		temp = rcu_dereference_check(temp->hnext,
+					lockdep_is_held(&kwatch_mutex));
+	}
 
-OUT:
-	return ret;
+	return temp;
 }
 
 /*
- * Function to get the memory for a particular head
+ * Queue a change in the stage ring of the current CPU
+ * The watch is identified by its key, never by its head,
+ * so that the record stays valid even if the watch goes away
+ * Hooks can not sleep, so merging is left to merge_work once the
+ * ring is half full, or right away while the feed has readers
+ * A change which the newest record can take is added to it instead,
+ * see coalesce_stage(). One arriving while the ring is full is lost,
+ * and its watch marked as needing a rescan
+ * Interrupts are off while the record is written, so that the ring
+ * only ever has one writer
  */
-int set_handle(int inode_num)
+void stage_change(const struct kwatch_key *watch,
+			const struct kwatch_key *key, unsigned long bits,
+			loff_t start, loff_t len)
 {
-	struct head_node *head;
-	int ret = -1;
-
-	head = kmalloc(sizeof(struct head_node), GFP_KERNEL);
-	if (NULL == head) {
-		goto OUT;
+	struct stage_ring *ring;
+	struct stage_rec *rec;
+	unsigned long flags;
+	unsigned int head, used;
+
+	local_irq_save(flags);
+	ring = this_cpu_ptr(&stage_rings);
+	head = ring->head;
+	used = head - smp_load_acquire(&ring->tail);
+	if (used && coalesce_stage(&ring->rec[(head - 1) & (_STAGE_LEN_ - 1)],
+					watch, key, bits, start, len)) {
+		hook_stat_inc(staged);
+		local_irq_restore(flags);
+		return;
 	}
 
-	/* Fill up the temporary head */
-	head->inode = inode_num;
-	head->next = NULL;
-	head->data = NULL;
-	head->num_data = 0;
+	if (used < _STAGE_LEN_) {
+		rec = &ring->rec[head & (_STAGE_LEN_ - 1)];
+		rec->watch = *watch;
+		rec->key = *key;
+		rec->bits = bits;
+		rec->start = start;
+		rec->len = len;
+		rec->stamp = jiffies;
+		rec->state = _STAGE_OPEN_;
+		smp_store_release(&ring->head, head + 1);
+		hook_stat_inc(staged);
+	}
 
-	/* Insert the head in the correct place */
-	ret = insert_obj(head);
+	local_irq_restore(flags);
 
-OUT:
-	if (ret < 0) {
-		if (head) {
-			kfree(head);
-			head = NULL;
-		}
+	if (used >= _STAGE_LEN_) {
+		stage_overflow(watch);
+	} else if (used + 1 >= _STAGE_LEN_ / 2
+			|| atomic_read(&num_feeds)) {
+		schedule_work(&merge_work);
 	}
-
-	return ret;
 }
 
 /*
- * Return the inode for a particular filename and checks if it is a file or
- * directory depending on the second parameters value return -errno if
- * failure returns 0 if success
- *
- * Security feature:
- * Also checks if the process opening the file is the owner of the file
+ * Add a change to rec, the newest record of a ring, if it is of the
+ * same file and kind and the ranges meet, so that a file written in
+ * small pieces fills one record and not the ring
+ * The merge may be copying rec from another CPU: it sets its state to
+ * TAKEN first, after which it is left alone, and waits while it is
+ * BUSY being added to
+ * 1 - added to rec
+ * 0 - has to be queued on its own
  */
-int get_inode(const char *const filename, unsigned long *inodeNo)
+int coalesce_stage(struct stage_rec *rec, const struct kwatch_key *watch,
+			const struct kwatch_key *key, unsigned long bits,
+			loff_t start, loff_t len)
 {
-	int errno = -EINVAL;
-	struct file *dirPtr = NULL;
-	struct inode *dir_inode = NULL;
-
-	*inodeNo = 0;
-	/* Open I/P file. It will report error in case of non-existing file
-	and bad permissions but not bad owner */
-	dirPtr = filp_open(filename, O_RDONLY, 0);
-	if (!dirPtr || IS_ERR(dirPtr)) {
-		errno = (int)PTR_ERR(dirPtr);
-		dirPtr = NULL;
-		goto OUT;
+	loff_t end;
+	int ret = 0;
+
+	if (cmpxchg(&rec->state, _STAGE_OPEN_, _STAGE_BUSY_) != _STAGE_OPEN_) {
+		return 0;
 	}
 
-	/*Get the inode of the open file */
-	dir_inode = dirPtr->f_path.dentry->d_inode;
+	if (rec->bits != bits || !key_equal(&rec->key, key)
+			|| !key_equal(&rec->watch, watch)) {
+		goto OUT;
+	}
 
-	/* Check if the file ptr belongs to a directory */
-	if (!(S_ISDIR(dir_inode->i_mode) || S_ISREG(dir_inode->i_mode))) {
-		errno = -EBADF;
+	/* Changes without a range only meet one another */
+	if (0 == len || 0 == rec->len) {
+		ret = (len == rec->len);
 		goto OUT;
 	}
 
-	/* Check if the I/p file and the process owner match */
-	if ((current->real_cred->uid != dir_inode->i_uid)
-			&& (current->real_cred->uid != 0)) {
-		errno = -EACCES;
+	if ((rec->len != _TO_EOF_ && start > rec->start + rec->len)
+			|| (len != _TO_EOF_ && rec->start > start + len)) {
 		goto OUT;
 	}
 
-	/*Take inode number and store */
-	*inodeNo = dir_inode->i_ino;
+	if (rec->len == _TO_EOF_ || len == _TO_EOF_) {
+		end = _TO_EOF_;
+	} else {
+		end = max(rec->start + rec->len, start + len);
+	}
 
-	errno = 0;
+	rec->start = min(rec->start, start);
+	rec->len = (end == _TO_EOF_) ? _TO_EOF_ : end - rec->start;
+	rec->stamp = jiffies;
+	ret = 1;
 
 OUT:
-	if (dirPtr) {
-		filp_close(dirPtr, NULL);
-		dirPtr = NULL;
-	}
-
-	return errno;
+	smp_store_release(&rec->state, _STAGE_OPEN_);
+	return ret;
 }
 
-
 /*
- * Takes a file name and checks recursively if any parent of this
- * file/folder is under watch
+ * Tell whoever reads watch that it has to be rescanned, its list of
+ * changes misses some
  */
-unsigned long check_if_any_parent_is_watched(char *fileName)
+void rescan_watch(const struct kwatch_key *watch)
 {
-	int errno;
-	unsigned long parentInodeNo = 0;
-	struct file *filePtr = NULL;
+	struct head_node *head;
 
-	filePtr = filp_open(fileName, O_RDONLY, 0);
-	if (!filePtr || IS_ERR(filePtr)) {
-		errno = (int)PTR_ERR(filePtr);
-		filePtr = NULL;
-		goto OUT;
+	rcu_read_lock();
+	head = is_stat(watch);
+	if (head != NULL) {
+		set_bit(_HEAD_RESCAN_BIT_, &head->flags);
 	}
+	rcu_read_unlock();
+}
 
-	parentInodeNo = check_if_any_parent_is_watched_filp(filePtr);
+/*
+ * A change of watch could not be queued
+ * Its list of changes misses it from now on, so tell whoever reads it
+ * that the watch has to be rescanned
+ */
+void stage_overflow(const struct kwatch_key *watch)
+{
+	atomic_inc(&stage_drops);
+	rescan_watch(watch);
 
-OUT:
-	if (filePtr) {
-		filp_close(filePtr, NULL);
-		filePtr = NULL;
-	}
-	return parentInodeNo;
+	printk_ratelimited(KERN_WARNING
+		"kWatch: stage ring full, watch %lu needs a rescan\n",
+		watch->ino);
+	schedule_work(&merge_work);
 }
 
 /*
- * Takes a file ptr and checks if any parent is under watch
- * fileptr can be obtained from an fd and from a file name too and then
- * passed to this function
- * Assumes filePtr is a valid file pointer
+ * Move the changes queued on every CPU into the watches
+ * Each ring is copied out first, so that it is free again before
+ * anything is allocated
+ * Records of watches which do not exist anymore are dropped, and every
+ * watch is flagged for a rescan if a hook missed a call, as are those
+ * of io_uring writes which never completed
+ * Caller holds kwatch_mutex
  */
-unsigned long check_if_any_parent_is_watched_filp(struct file *filePtr)
+void drain_stages(void)
 {
-	unsigned long parentInodeNo = 0, tempno = 0;
-	struct dentry *parentPtr = NULL;
+	struct stage_ring *ring;
+	struct stage_rec *rec;
+	struct head_node *head;
+	unsigned int tail, end;
+	int cpu, count, i;
 
-	/* To Prevent the parent dentry loop from going in an infinite loop */
-	int i = 0;
+	check_missed();
+	expire_async_writes();
 
-	/* Get the dentry of the parent of the open file */
-	parentPtr = filePtr->f_path.dentry->d_parent;
-	while (parentPtr != NULL && i < 20) {
-		tempno = parentPtr->d_inode->i_ino;
-		if (is_stat(tempno)) {
-			parentInodeNo = tempno;
-			break;
-		} else if (IS_ROOT(parentPtr)) {
-			break;
-		} else {
-			i++;
-			parentPtr = parentPtr->d_parent;
+	for_each_possible_cpu(cpu) {
+		ring = &per_cpu(stage_rings, cpu);
+
+		end = smp_load_acquire(&ring->head);
+		if (end != ring->tail) {
+			rec = &ring->rec[(end - 1) & (_STAGE_LEN_ - 1)];
+			while (cmpxchg(&rec->state, _STAGE_OPEN_,
+					_STAGE_TAKEN_) == _STAGE_BUSY_) {
+				cpu_relax();
+			}
+		}
+
+		count = 0;
+		for (tail = ring->tail; tail != end; tail++) {
+			merge_buf[count++] =
+				ring->rec[tail & (_STAGE_LEN_ - 1)];
 		}
-	}
 
-	return parentInodeNo;
+		smp_store_release(&ring->tail, tail);
+
+		for (i = 0; i < count; i++) {
+			head = is_stat(&merge_buf[i].watch);
+			if (head != NULL) {
+				head->events++;
+				head->last_event = merge_buf[i].stamp;
+				add_data_to_obj(head, &merge_buf[i].key,
+						merge_buf[i].bits,
+						merge_buf[i].start,
+						merge_buf[i].len);
+				if (!list_empty(&feeds))
+					feed_change(&merge_buf[i]);
+			}
+		}
+	}
 }
 
 /*
- * System call to get the buffer of files changed
- * in a directory
+ * Same as drain_stages(), for callers not holding kwatch_mutex
  */
-asmlinkage int my_get_watch(const char * const file, void *user_buf,
-							int buf_len)
+void merge_stages(void)
 {
+	mutex_lock(&kwatch_mutex);
+	drain_stages();
+	mutex_unlock(&kwatch_mutex);
+}
+
+void merge_work_fn(struct work_struct *work)
+{
+	merge_stages();
+}
+
+/*
+ * Allocate a zeroed bucket array with 2^bits entries
+ * Bigger tables come from vmalloc so that growing the hash
+ * of a busy watch does not depend on high order pages
+ */
+struct data_node **alloc_hash(unsigned int bits)
+{
+	size_t size = sizeof(struct data_node *) << bits;
+
+	if (size <= PAGE_SIZE)
+		return kzalloc(size, GFP_KERNEL);
+
+	return vzalloc(size);
+}
+
+/*
+ * Free a bucket array allocated by alloc_hash()
+ */
+void free_hash(struct data_node **hash, unsigned int bits)
+{
+	if (hash == NULL)
+		return;
+
+	if ((sizeof(struct data_node *) << bits) <= PAGE_SIZE)
+		kfree(hash);
+	else
+		vfree(hash);
+}
+
+/*
+ * Look up the data node of an inode under a watched directory
+ * Returns NULL if the inode has not been recorded yet
+ */
+struct data_node *find_data(struct head_node *head,
+			const struct kwatch_key *key)
+{
+	struct data_node *temp;
+
+	temp = head->hash[hash_key(key, head->hash_bits)];
+	while (temp != NULL) {
+		if (key_equal(&temp->key, key))
+			break;
+
+		temp = temp->hnext;
+	}
+
+	return temp;
+}
+
+/*
+ * Link a data node into the hash of its head
+ */
+void hash_data(struct head_node *head, struct data_node *node)
+{
+	struct data_node **bucket;
+
+	bucket = &head->hash[hash_key(&node->key, head->hash_bits)];
+	node->hnext = *bucket;
+	*bucket = node;
+}
+
+/*
+ * Unlink a data node from the hash of its head
+ */
+void unhash_data(struct head_node *head, struct data_node *node)
+{
+	struct data_node **link;
+
+	link = &head->hash[hash_key(&node->key, head->hash_bits)];
+	while (*link != node)
+		link = &(*link)->hnext;
+
+	*link = node->hnext;
+	node->hnext = NULL;
+}
+
+/*
+ * Unlink a data node from the list of changes of its head
+ */
+void unlink_data(struct head_node *head, struct data_node *node)
+{
+	if (node->prev != NULL)
+		node->prev->next = node->next;
+	else
+		head->data = node->next;
+
+	if (node->next != NULL)
+		node->next->prev = node->prev;
+	else
+		head->tail = node->prev;
+
+	node->next = NULL;
+	node->prev = NULL;
+}
+
+/*
+ * First data node changed after sequence number since, NULL if none
+ * The list being sorted by seq, it is found walking back from the
+ * tail over the nodes to be returned only
+ */
+struct data_node *first_since(struct head_node *head,
+			unsigned long long since)
+{
+	struct data_node *node = head->tail;
+
+	if (node == NULL || node->seq <= since)
+		return NULL;
+
+	while (node->prev != NULL && node->prev->seq > since)
+		node = node->prev;
+
+	return node;
+}
+
+/*
+ * Double the number of buckets of a head and rehash its nodes
+ * If the bigger table can not be allocated we simply keep the
+ * old one, lookups get slower but stay correct
+ */
+void grow_hash(struct head_node *head)
+{
+	struct data_node **old_hash = head->hash;
+	unsigned int old_bits = head->hash_bits;
+	struct data_node *temp;
+
+	if (old_bits >= _HASH_MAX_BITS_)
+		return;
+
+	head->hash = alloc_hash(old_bits + 1);
+	if (head->hash == NULL) {
+		head->hash = old_hash;
+		return;
+	}
+
+	head->hash_bits = old_bits + 1;
+	head->mem += sizeof(struct data_node *) << old_bits;
+	for (temp = head->data; temp != NULL; temp = temp->next)
+		hash_data(head, temp);
+
+	free_hash(old_hash, old_bits);
+}
+
+/*
+ * Empty the hash of a head whose data nodes are being freed
+ * Shrinks it back to the minimum size when possible
+ */
+void reset_hash(struct head_node *head)
+{
+	struct data_node **new_hash;
+
+	new_hash = alloc_hash(_HASH_MIN_BITS_);
+	if (new_hash == NULL) {
+		memset(head->hash, 0,
+			sizeof(struct data_node *) << head->hash_bits);
+		return;
+	}
+
+	head->mem -= (sizeof(struct data_node *) << head->hash_bits) -
+			(sizeof(struct data_node *) << _HASH_MIN_BITS_);
+	free_hash(head->hash, head->hash_bits);
+	head->hash = new_hash;
+	head->hash_bits = _HASH_MIN_BITS_;
+}
+
+/*
+ * Double the room for the ranges of a data node, moving them out of
+ * the node on first use. Never grows beyond _MAX_EXTENTS_
+ */
+int grow_extents(struct data_node *node)
+{
+	struct extent *new_ext;
+	int new_max;
+
+	if (node->max_ext >= _MAX_EXTENTS_)
+		return -ENOSPC;
+
+	new_max = node->max_ext * 2;
+	if (new_max > _MAX_EXTENTS_)
+		new_max = _MAX_EXTENTS_;
+
+	new_ext = kmalloc(new_max * sizeof(struct extent), GFP_KERNEL);
+	if (new_ext == NULL)
+		return -ENOMEM;
+
+	memcpy(new_ext, node->ext, node->num_ext * sizeof(struct extent));
+	if (node->ext != node->inl_ext)
+		kfree(node->ext);
+
+	node->ext = new_ext;
+	node->max_ext = new_max;
+	return 0;
+}
+
+/*
+ * Make room for one more range by merging the two ranges with the
+ * smallest gap between them. Needs at least two ranges
+ */
+void merge_closest_extents(struct data_node *node)
+{
+	struct extent *ext = node->ext;
+	unsigned long gap, best_gap = _EXTENT_EOF_;
+	int i, best = 0;
+
+	for (i = 0; i + 1 < node->num_ext; i++) {
+		gap = ext[i + 1].start - ext[i].end;
+		if (gap < best_gap) {
+			best_gap = gap;
+			best = i;
+		}
+	}
+
+	ext[best].end = ext[best + 1].end;
+	memmove(&ext[best + 1], &ext[best + 2],
+		(node->num_ext - best - 2) * sizeof(struct extent));
+	node->num_ext--;
+}
+
+/*
+ * Record chunks first to last as changed
+ * Ranges overlapping or touching the new one are merged with it,
+ * so the ranges of a node always stay sorted and disjoint
+ */
+void add_extent(struct data_node *node, unsigned long first,
+			unsigned long last)
+{
+	struct extent *ext;
+	int i, j;
+
+	for (;;) {
+		ext = node->ext;
+
+		/* Skip the ranges ending before first - 1 */
+		for (i = 0; i < node->num_ext; i++) {
+			if (first == 0 || ext[i].end >= first - 1)
+				break;
+		}
+
+		/* Swallow the ranges starting up to last + 1 */
+		for (j = i; j < node->num_ext; j++) {
+			if (last != _EXTENT_EOF_ && ext[j].start > last + 1)
+				break;
+
+			if (ext[j].start < first)
+				first = ext[j].start;
+			if (ext[j].end > last)
+				last = ext[j].end;
+		}
+
+		if (j > i) {
+			ext[i].start = first;
+			ext[i].end = last;
+			memmove(&ext[i + 1], &ext[j],
+				(node->num_ext - j) * sizeof(struct extent));
+			node->num_ext -= j - i - 1;
+			return;
+		}
+
+		if (node->num_ext < node->max_ext || grow_extents(node) == 0) {
+			ext = node->ext;
+			memmove(&ext[i + 1], &ext[i],
+				(node->num_ext - i) * sizeof(struct extent));
+			ext[i].start = first;
+			ext[i].end = last;
+			node->num_ext++;
+			return;
+		}
+
+		/* Out of room, trade some precision for it and retry */
+		merge_closest_extents(node);
+	}
+}
+
+/*
+ * Function to add inode info under a watched directory's inode
+ * This is to be added to the chain of data connected to a head
+ * Also takes the change bits and the changed byte range, len being 0
+ * if no data changed. If the data is already present, the changes
+ * are merged with the ones recorded so far, and it moves to the tail
+ * Either way it gets the next sequence number of the watch
+ * A change there is no memory for is lost, the head is then marked
+ * as needing a rescan
+ */
+void add_data_to_obj(struct head_node *head, const struct kwatch_key *key,
+			unsigned long bits, loff_t start, loff_t len)
+{
+	struct data_node *new_node;
+	unsigned long first, last;
+	int max_ext;
+
+	/* Already recorded, only merge the changes */
+	new_node = find_data(head, key);
+	if (new_node != NULL) {
+		records_merged++;
+		head->coalesced++;
+		new_node->seq = ++head->seq;
+		if (new_node != head->tail) {
+			unlink_data(head, new_node);
+			goto LINK;
+		}
+
+		goto MERGE;
+	}
+
+	new_node = kmem_cache_alloc(data_cache, GFP_KERNEL);
+	if (new_node == NULL) {
+		set_bit(_HEAD_RESCAN_BIT_, &head->flags);
+		goto OUT;
+	}
+
+	records_created++;
+	head->mem += sizeof(struct data_node);
+	new_node->key = *key;
+	new_node->bits = 0;
+	new_node->seq = ++head->seq;
+	new_node->hnext = NULL;
+	new_node->ext = new_node->inl_ext;
+	new_node->num_ext = 0;
+	new_node->max_ext = _INLINE_EXTENTS_;
+	head->num_data++;
+	hash_data(head, new_node);
+
+	if (head->num_data > (_HASH_MAX_LOAD_ << head->hash_bits)) {
+		grow_hash(head);
+	}
+
+LINK:
+	new_node->next = NULL;
+	new_node->prev = head->tail;
+	if (head->data == NULL) {
+		head->data = new_node;
+	} else {
+		head->tail->next = new_node;
+	}
+
+	head->tail = new_node;
+
+MERGE:
+	new_node->bits |= bits;
+	if (len == 0 || start < 0) {
+		goto OUT;
+	}
+
+	first = start >> head->block_bits;
+	if (len == _TO_EOF_) {
+		last = _EXTENT_EOF_;
+	} else {
+		last = (start + len - 1) >> head->block_bits;
+	}
+
+	/* Account for the ranges moving out of the node, or growing */
+	max_ext = new_node->max_ext;
+	add_extent(new_node, first, last);
+	if (new_node->max_ext != max_ext) {
+		head->mem += sizeof(struct extent) * new_node->max_ext;
+		if (max_ext > _INLINE_EXTENTS_)
+			head->mem -= sizeof(struct extent) * max_ext;
+	}
+
+OUT:
+	return;
+}
+
+/*
+ * Fill the record handed to the user for a data node
+ * Chunks which do not fit in the bitmap are folded in _FILE_REST_
+ */
+void fill_user_node(struct data_node *node, struct user_data_node *rec)
+{
+	unsigned long chunk, last;
+	int i;
+
+	memset(rec, 0, sizeof(struct user_data_node));
+	rec->inode = node->key.ino;
+	rec->bMap[0] = node->bits & ((1 << _CHANGE_MIN_) - 1);
+
+	for (i = 0; i < node->num_ext; i++) {
+		last = node->ext[i].end;
+		if (last > _CHANGE_MAX_ - _CHANGE_OFFSET_) {
+			set_bit(_FILE_REST_, (void *)rec->bMap);
+			last = _CHANGE_MAX_ - _CHANGE_OFFSET_;
+		}
+
+		for (chunk = node->ext[i].start; chunk <= last; chunk++)
+			set_bit(chunk + _CHANGE_OFFSET_, (void *)rec->bMap);
+	}
+}
+
+/*
+ * Copy the changed byte ranges of a file under a watch to user_buf
+ * Returns the number of ranges copied, 0 if nothing is recorded for
+ * the file. With a query, resumes from the range its cursor points at
+ * Caller holds kwatch_mutex
+ */
+int get_extents(char *fileName, const struct kwatch_key *key,
+			void *user_buf, int buf_len, struct user_query *query)
+{
+	struct head_node *head;
+	struct data_node *node;
+	struct user_extent rec;
+	struct kwatch_key watch;
+	int errno = 0;
+	int num, first = 0, i;
+
+	if (!check_if_any_parent_is_watched(fileName, &watch)) {
+		goto OUT;
+	}
+
+	head = is_stat(&watch);
+	if (NULL == head) {
+		goto OUT;
+	}
+
+	if (query && (query->flags & _QUERY_SNAPSHOT_)) {
+		head = head->snap;
+		if (NULL == head) {
+			goto OUT;
+		}
+	}
+
+	node = find_data(head, key);
+	if (NULL == node || 0 == node->num_ext) {
+		goto OUT;
+	}
+
+	if (query && (query->flags & _QUERY_MORE_)) {
+		if (query->epoch != head->epoch ||
+				query->cursor_ext >= node->num_ext) {
+			errno = -ESTALE;
+			goto OUT;
+		}
+
+		first = query->cursor_ext;
+	}
+
+	num = buf_len / sizeof(struct user_extent);
+	if (num > node->num_ext - first) {
+		num = node->num_ext - first;
+	}
+
+	/* Headers before version 5 have no cursor: all of it, or nothing */
+	if (query && query->version < 5 && num < node->num_ext) {
+		num = 0;
+	}
+
+	if (num <= 0) {
+		errno = -EINVAL;
+		goto OUT;
+	}
+
+	/* Copied one at a time, whatever the size of user_buf */
+	for (i = 0; i < num; i++) {
+		rec.offset = (unsigned long long)node->ext[first + i].start
+					<< head->block_bits;
+		if (node->ext[first + i].end == _EXTENT_EOF_) {
+			rec.length = ~0ULL;
+		} else {
+			rec.length = (unsigned long long)
+				(node->ext[first + i].end -
+				 node->ext[first + i].start + 1)
+				<< head->block_bits;
+		}
+
+		if (copy_to_user((struct user_extent *)user_buf + i, &rec,
+				sizeof(rec))) {
+			errno = -EFAULT;
+			goto OUT;
+		}
+	}
+
+	if (query) {
+		query->epoch = head->epoch;
+		query->flags &= _QUERY_SNAPSHOT_;
+		if (first + num < node->num_ext) {
+			query->flags |= _QUERY_MORE_;
+			query->cursor_ext = first + num;
+		}
+	}
+
+	errno = num;
+
+OUT:
+	return errno;
+}
+
+/*
+ * Copy the changes recorded under a watch to user_buf, num at most
+ * Returns the number of records copied. With a query, resumes right
+ * after the file its cursor names: a file changing again moves to the
+ * tail of the list with a higher seq, so the records come out in the
+ * order of their last change, and a file which changed after being
+ * read comes out again. If the cursor file moved or went away, the
+ * read resumes from its seq instead
+ * With since, only the files changed after it are copied, and only
+ * those matching the filters of the query: the others are skipped
+ * here rather than copied for the user to drop
+ * Caller holds kwatch_mutex
+ */
+int get_changes(struct head_node *head, void *user_buf, int num,
+			struct user_query *query)
+{
+	struct data_node *node = head->data;
+	struct data_node *last = NULL;
+	struct user_data_node rec;
+	int i = 0;
+
+	if (query) {
+		node = query_start(head, query);
+		if (IS_ERR(node)) {
+			return PTR_ERR(node);
+		}
+	}
+
+	/* Copied one at a time, whatever the size of user_buf */
+	while (i < num && node != NULL) {
+		if (query && !match_query(node, query)) {
+			last = node;
+			node = node->next;
+			continue;
+		}
+
+		fill_user_node(node, &rec);
+		if (copy_to_user((struct user_data_node *)user_buf + i, &rec,
+				sizeof(rec))) {
+			return -EFAULT;
+		}
+
+		last = node;
+		node = node->next;
+		i++;
+	}
+
+	if (query) {
+		query_done(head, query, node, last);
+	}
+
+	return i;
+}
+
+/*
+ * First data node a query reads, resuming from its cursor or since
+ * Returns ERR_PTR(-ESTALE) if the watch was flushed in between
+ */
+struct data_node *query_start(struct head_node *head,
+			struct user_query *query)
+{
+	struct data_node *node = head->data;
+	struct kwatch_key key;
+
+	if (query->flags & _QUERY_MORE_) {
+		key.ino = query->cursor_ino;
+		key.dev = query->cursor_dev;
+		key.gen = query->cursor_gen;
+
+		if (query->epoch != head->epoch) {
+			return ERR_PTR(-ESTALE);
+		}
+
+		node = find_data(head, &key);
+		if (node != NULL && node->seq == query->cursor_seq) {
+			node = node->next;
+		} else {
+			node = first_since(head, query->cursor_seq);
+		}
+	} else if (query->since) {
+		if (query->epoch != head->epoch) {
+			return ERR_PTR(-ESTALE);
+		}
+
+		node = first_since(head, query->since);
+	}
+
+	return node;
+}
+
+/*
+ * Fill the header of a query once read: node is the next data node to
+ * read, NULL if none is left, last the last one read
+ */
+void query_done(struct head_node *head, struct user_query *query,
+			struct data_node *node, struct data_node *last)
+{
+	query->epoch = head->epoch;
+	query->seq = head->seq;
+	query->flags &= _QUERY_SNAPSHOT_;
+	if (test_bit(_HEAD_RESCAN_BIT_, &head->flags)) {
+		query->flags |= _QUERY_RESCAN_;
+	}
+
+	if (node != NULL && last != NULL) {
+		query->flags |= _QUERY_MORE_;
+		query->cursor_ino = last->key.ino;
+		query->cursor_dev = last->key.dev;
+		query->cursor_gen = last->key.gen;
+		query->cursor_seq = last->seq;
+	}
+}
+
+/*
+ * Write v as a varint at p, returns the number of bytes written
+ */
+int put_varint(unsigned char *p, unsigned long long v)
+{
+	int i = 0;
+
+	while (v >= 0x80) {
+		p[i++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+
+	p[i++] = v;
+
+	return i;
+}
+
+/*
+ * Pack the record of a data node in buf, _REC_MAX_ bytes at least,
+ * see struct kwatch_rec. Returns its length
+ * With _QUERY_HANDLE_ or _QUERY_PATH_ in flags, its file is looked up
+ * on the filesystem of root, the watched directory
+ */
+int pack_record(struct data_node *node, unsigned char *buf,
+			struct path *root, unsigned int flags)
+{
+	struct kwatch_rec *rec = (struct kwatch_rec *)buf;
+	unsigned char *map = buf + sizeof(struct kwatch_rec);
+	struct super_block *sb;
+	struct inode *inode = NULL;
+	struct dentry *dentry = NULL;
+	unsigned long next = 0;
+	int i, len;
+
+	rec->bits = node->bits & (((1 << _CHANGE_MIN_) - 1) | S_IFMT);
+	rec->dev = node->key.dev;
+	rec->gen = node->key.gen;
+	rec->ino = node->key.ino;
+	rec->seq = node->seq;
+
+	/* A range up to the end of the file is always the last one */
+	map += put_varint(map, node->num_ext);
+	for (i = 0; i < node->num_ext; i++) {
+		map += put_varint(map, node->ext[i].start - next);
+		if (node->ext[i].end == _EXTENT_EOF_) {
+			map += put_varint(map, 0);
+			break;
+		}
+
+		map += put_varint(map,
+				node->ext[i].end - node->ext[i].start + 1);
+		next = node->ext[i].end + 1;
+	}
+
+	if (node->bits & (1UL << _FILE_DELETE_BIT_)) {
+		/* Nothing leads to a deleted file any more */
+		if (flags & _QUERY_HANDLE_) {
+			map += put_varint(map, 0);
+			map += put_varint(map, 0);
+		}
+
+		if (flags & _QUERY_PATH_) {
+			map += put_varint(map, 0);
+		}
+	} else if (flags & (_QUERY_HANDLE_ | _QUERY_PATH_)) {
+		sb = root->dentry->d_sb;
+		inode = lookup_key(&node->key, sb);
+		if (inode) {
+			dentry = d_find_alias(inode);
+		}
+
+		if (flags & _QUERY_HANDLE_) {
+			map += put_handle(&node->key, dentry, sb, map);
+		}
+
+		if (flags & _QUERY_PATH_) {
+			map += put_path(dentry, root, map);
+		}
+
+		if (dentry) {
+			dput(dentry);
+		}
+
+		if (inode) {
+			iput(inode);
+		}
+	}
+
+	len = map - buf;
+	while (len & 3)
+		buf[len++] = 0;
+
+	rec->len = len;
+
+	return len;
+}
+
+/*
+ * Find the inode of a key in memory, on sb. NULL if it is not there,
+ * if the inode number was reused since or if its last link is gone
+ * Caller puts the inode
+ */
+struct inode *lookup_key(const struct kwatch_key *key,
+			struct super_block *sb)
+{
+	struct inode *inode;
+
+	if (key->dev != sb->s_dev) {
+		return NULL;
+	}
+
+	inode = ilookup(sb, key->ino);
+	if (inode && (inode->i_generation != key->gen ||
+			0 == inode->i_nlink)) {
+		iput(inode);
+		inode = NULL;
+	}
+
+	return inode;
+}
+
+/*
+ * Write the handle of the file of key at p, see struct kwatch_rec,
+ * encoded by its filesystem as name_to_handle_at() does from dentry
+ * Without a dentry, the inode is no longer in memory: the handle is
+ * built from the key if the filesystem encodes its handles the
+ * default way, as the number and generation of the inode
+ * Returns the number of bytes written
+ */
+int put_handle(const struct kwatch_key *key, struct dentry *dentry,
+			struct super_block *sb, unsigned char *p)
+{
+	u32 fh[_HANDLE_MAX_ / 4];
+	int type = FILEID_INVALID;
+	int words = _HANDLE_MAX_ / 4;
+	int len;
+
+	if (NULL == sb->s_export_op) {
+		/* Not exportable, name_to_handle_at() fails too */
+	} else if (dentry) {
+		type = exportfs_encode_fh(dentry, (void *)fh, &words, 0);
+	} else if (key->dev == sb->s_dev &&
+			kwatch_default_fh(sb->s_export_op) &&
+			0 == ((u64)key->ino >> 32)) {
+		fh[0] = key->ino;
+		fh[1] = key->gen;
+		words = 2;
+		type = FILEID_INO32_GEN;
+	}
+
+	if (type < 0 || type == FILEID_INVALID ||
+			words > _HANDLE_MAX_ / 4) {
+		type = 0;
+		words = 0;
+	}
+
+	len = put_varint(p, type);
+	len += put_varint(p + len, words * 4);
+	memcpy(p + len, fh, words * 4);
+
+	return len + words * 4;
+}
+
+/*
+ * Write the path of dentry relative to root at p, see struct
+ * kwatch_rec. Both are on the same filesystem, so their paths from its
+ * root only differ by that of root
+ * Returns the number of bytes written
+ * Caller holds kwatch_mutex, for path_buf
+ */
+int put_path(struct dentry *dentry, struct path *root, unsigned char *p)
+{
+	char *name;
+	int len, skip;
+
+	if (NULL == dentry || d_unlinked(dentry) ||
+			!is_subdir(dentry, root->dentry)) {
+		return put_varint(p, 0);
+	}
+
+	name = dentry_path_raw(root->dentry, path_buf, _PATH_MAX_);
+	if (IS_ERR(name)) {
+		return put_varint(p, 0);
+	}
+
+	/* "/" for the root of the filesystem, "/a/b" below it */
+	skip = strlen(name);
+	if (skip == 1) {
+		skip = 0;
+	}
+
+	name = dentry_path_raw(dentry, path_buf, _PATH_MAX_);
+	if (IS_ERR(name) || (int)strlen(name) < skip) {
+		return put_varint(p, 0);
+	}
+
+	name += skip;
+	if ('/' == *name) {
+		name++;
+	}
+
+	/* The watched directory itself */
+	if ('\0' == *name) {
+		name = ".";
+	}
+
+	len = strlen(name);
+	skip = put_varint(p, len);
+	memcpy(p + skip, name, len);
+
+	return skip + len;
+}
+
+/*
+ * Copy the changes recorded under a watch to user_buf as packed
+ * records, as many as fit in buf_len bytes. Otherwise the same as
+ * get_changes()
+ * root is the watched directory, for the handles and paths asked for
+ * by the flags of the query
+ * Returns the number of records copied, -ENOSPC if not even the first
+ * one fits
+ * Caller holds kwatch_mutex
+ */
+int get_records(struct head_node *head, void *user_buf, int buf_len,
+			struct user_query *query, struct path *root)
+{
+	struct data_node *node;
+	struct data_node *last = NULL;
+	int len, used = 0, i = 0;
+
+	node = query_start(head, query);
+	if (IS_ERR(node)) {
+		return PTR_ERR(node);
+	}
+
+	while (node != NULL) {
+		if (!match_query(node, query)) {
+			last = node;
+			node = node->next;
+			continue;
+		}
+
+		len = pack_record(node, rec_buf, root,
+				root ? query->flags : 0);
+		if (used + len > buf_len) {
+			break;
+		}
+
+		if (copy_to_user(user_buf + used, rec_buf, len)) {
+			return -EFAULT;
+		}
+
+		used += len;
+		last = node;
+		node = node->next;
+		i++;
+	}
+
+	if (node != NULL && last == NULL) {
+		return -ENOSPC;
+	}
+
+	query_done(head, query, node, last);
+	query->chunk_bits = head->block_bits;
+	query->rec_fixed = sizeof(struct kwatch_rec);
+
+	return i;
+}
+
+/*
+ * Does a data node match the filters of a query
+ */
+int match_query(struct data_node *node, struct user_query *query)
+{
+	unsigned long chunks = 0;
+	int i;
+
+	if (query->mask && !(node->bits & query->mask)) {
+		return 0;
+	}
+
+	if (query->type && (node->bits & S_IFMT) != query->type) {
+		return 0;
+	}
+
+	if (query->min_chunks == 0) {
+		return 1;
+	}
+
+	for (i = 0; i < node->num_ext; i++) {
+		if (node->ext[i].end == _EXTENT_EOF_) {
+			return 1;
+		}
+
+		chunks += node->ext[i].end - node->ext[i].start + 1;
+		if (chunks >= query->min_chunks) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Copy the watched directories to user_buf, num at most
+ * With a query, resumes right after the watch its cursor names, and
+ * copies a struct user_watch per watch. Without, it copies the inode
+ * number alone, an unsigned long per watch, as it always did
+ * Caller holds kwatch_mutex
+ */
+int get_watch_list(void *user_buf, int num, struct user_query *query)
+{
+	struct head_node *head = main_obj->next;
+	struct head_node *last = NULL;
+	struct user_watch rec;
+	struct kwatch_key key;
+	int i = 0;
+
+	if (query && (query->flags & _QUERY_MORE_)) {
+		key.ino = query->cursor_ino;
+		key.dev = query->cursor_dev;
+		key.gen = query->cursor_gen;
+
+		head = is_stat(&key);
+		if (head == NULL) {
+			return -ESTALE;
+		}
+
+		head = head->next;
+	}
+
+	while (i < num && head != NULL) {
+		if (query == NULL) {
+			if (put_user(head->key.ino,
+					(unsigned long __user *)user_buf + i)) {
+				return -EFAULT;
+			}
+		} else {
+			rec.inode = head->key.ino;
+			rec.block_size = 1UL << head->block_bits;
+			if (copy_to_user((struct user_watch *)user_buf + i,
+					&rec, sizeof(rec))) {
+				return -EFAULT;
+			}
+		}
+
+		last = head;
+		head = head->next;
+		i++;
+	}
+
+	if (query) {
+		query->epoch = 0;
+		query->flags = 0;
+		if (head != NULL && last != NULL) {
+			query->flags = _QUERY_MORE_;
+			query->cursor_ino = last->key.ino;
+			query->cursor_dev = last->key.dev;
+			query->cursor_gen = last->key.gen;
+		}
+	}
+
+	return i;
+}
+
+/*
+ * Insert a new head object in the watch structure
+ * This just adds an entry to the main ds
+ * Changes will be added later to this heads data nodes
+ */
+int insert_obj(struct head_node *head)
+{
+	struct head_node *temp1;
+	unsigned long bucket;
+	int ret = -1;
+
+	if (is_stat(&head->key) != NULL) {
+		goto OUT;
+	}
+
+	temp1 = main_obj;
+	while (temp1->next != NULL)
+		temp1 = temp1->next;
+
+	temp1->next = head;
+
+	/* Publish the head only once it is fully set up */
+	bucket = hash_key(&head->key, _WATCH_HASH_BITS_);
+	head->hnext = watch_hash[bucket];
+	rcu_assign_pointer(watch_hash[bucket], head);
+	add_sb_watch(head->key.dev);
+	bump_watch_gen();
+	ret = 0;
+
+OUT:
+	return ret;
+}
+
+/*
+ * Function to get the memory for a particular head
+ */
+int set_handle(const struct kwatch_key *key, unsigned int block_bits)
+{
+	struct head_node *head;
+	int ret = -1;
+
+	head = kmem_cache_alloc(head_cache, GFP_KERNEL);
+	if (NULL == head) {
+		goto OUT;
+	}
+
+	/* Fill up the temporary head */
+	head->key = *key;
+	head->next = NULL;
+	head->hnext = NULL;
+	head->data = NULL;
+	head->tail = NULL;
+	head->num_data = 0;
+	head->hash_bits = _HASH_MIN_BITS_;
+	head->block_bits = block_bits;
+	head->flags = 0;
+	head->snap = NULL;
+	head->epoch = 0;
+	head->seq = 0;
+	head->consumers = 0;
+	head->events = 0;
+	head->coalesced = 0;
+	head->last_event = 0;
+	head->mem = sizeof(struct head_node) +
+			(sizeof(struct data_node *) << head->hash_bits);
+	head->hash = alloc_hash(head->hash_bits);
+	if (NULL == head->hash) {
+		goto OUT;
+	}
+
+	/* Insert the head in the correct place */
+	ret = insert_obj(head);
+	if (ret == 0) {
+		add_watch_proc(head);
+	}
+
+OUT:
+	if (ret < 0) {
+		if (head) {
+			free_hash(head->hash, head->hash_bits);
+			kmem_cache_free(head_cache, head);
+			head = NULL;
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Statistics of a watch, in /proc/kwatch/MAJOR:MINOR:INODE
+ * They come from the counters the merge keeps in the head, nothing is
+ * walked. Removing the file waits for its readers, which never wait
+ * for kwatch_mutex, so it is safe to remove it under the mutex and
+ * free the head right after
+ */
+int watch_proc_show(struct seq_file *m, void *v)
+{
+	struct head_node *head = m->private;
+	unsigned long events, coalesced;
+
+	/* Count what is still queued, unless the watches are busy */
+	if (mutex_trylock(&kwatch_mutex)) {
+		drain_stages();
+		mutex_unlock(&kwatch_mutex);
+	}
+
+	events = READ_ONCE(head->events);
+	coalesced = READ_ONCE(head->coalesced);
+
+	seq_printf(m, "records\t\t%d\n", READ_ONCE(head->num_data));
+	seq_printf(m, "memory\t\t%lu\n", READ_ONCE(head->mem));
+	seq_printf(m, "events\t\t%lu\n", events);
+	seq_printf(m, "coalesced\t%lu\n", coalesced);
+	seq_printf(m, "coalesce_ratio\t%lu%%\n",
+			events ? coalesced * 100 / events : 0);
+
+	if (events) {
+		seq_printf(m, "last_event\t%u s ago\n",
+			jiffies_to_msecs(jiffies -
+				READ_ONCE(head->last_event)) / 1000);
+	} else {
+		seq_puts(m, "last_event\tnever\n");
+	}
+
+	seq_printf(m, "chunk_size\t%lu\n", 1UL << head->block_bits);
+	seq_printf(m, "needs_rescan\t%d\n",
+			test_bit(_HEAD_RESCAN_BIT_, &head->flags) ? 1 : 0);
+	seq_printf(m, "epoch\t\t%u\n", READ_ONCE(head->epoch));
+	seq_printf(m, "seq\t\t%llu\n", head->seq);
+	seq_printf(m, "consumers\t%d\n",
+			hweight32(READ_ONCE(head->consumers)));
+
+	return 0;
+}
+
+int watch_proc_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, watch_proc_show, kwatch_pde_data(inode));
+}
+
+/*
+ * Proc files have their own operations since 5.6
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+const struct proc_ops watch_proc_fops = {
+	.proc_open	= watch_proc_open,
+	.proc_read	= seq_read,
+	.proc_lseek	= seq_lseek,
+	.proc_release	= single_release,
+};
+#else
+const struct file_operations watch_proc_fops = {
+	.owner		= THIS_MODULE,
+	.open		= watch_proc_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+#endif
+
+void watch_proc_name(const struct kwatch_key *key, char *name)
+{
+	snprintf(name, _PROC_NAME_LEN_, "%u:%u:%lu", MAJOR(key->dev),
+			MINOR(key->dev), key->ino);
+}
+
+/*
+ * The file is only a help, a watch works without it
+ */
+void add_watch_proc(struct head_node *head)
+{
+	char name[_PROC_NAME_LEN_];
+
+	if (proc_dir == NULL) {
+		return;
+	}
+
+	watch_proc_name(&head->key, name);
+	proc_create_data(name, 0444, proc_dir, &watch_proc_fops, head);
+}
+
+void rem_watch_proc(struct head_node *head)
+{
+	char name[_PROC_NAME_LEN_];
+
+	if (proc_dir == NULL) {
+		return;
+	}
+
+	watch_proc_name(&head->key, name);
+	remove_proc_entry(name, proc_dir);
+}
+
+/*
+ * Change feed: /dev/kwatch
+ * Every open file of the device gets its own ring of records, which
+ * the reader maps. Once subscribed to a watch with _FEED_IOC_WATCH_,
+ * every change the merge adds to the watch is published to the ring
+ * as well. head is only written here, tail only by the reader: once
+ * set up, neither side makes a system call to pass a change along
+ * A lagging reader is never overwritten. A change finding its ring
+ * full is left out of it and counted in dropped, the watch still has
+ * it: a reader seeing dropped move catches up with getWatch()
+ * The file polls readable once threshold records are unread, so that
+ * a reader can sleep until there is enough to be worth waking up for
+ * Caller holds kwatch_mutex
+ */
+void feed_change(const struct stage_rec *rec)
+{
+	struct feed *feed;
+	struct feed_rec *out;
+	unsigned int head;
+
+	list_for_each_entry(feed, &feeds, list) {
+		if (!feed->subscribed || !key_equal(&feed->watch, &rec->watch))
+			continue;
+
+		head = feed->hdr->head;
+		if (feed_unread(feed) >= _FEED_RECS_) {
+			feed->hdr->dropped++;
+			continue;
+		}
+
+		out = &feed->rec[head & (_FEED_RECS_ - 1)];
+		out->ino = rec->key.ino;
+		out->dev = rec->key.dev;
+		out->gen = rec->key.gen;
+		out->bits = rec->bits;
+		if (rec->len == 0) {
+			out->offset = 0;
+			out->length = 0;
+		} else {
+			out->offset = rec->start;
+			out->length = rec->len == _TO_EOF_ ? ~0ULL : rec->len;
+		}
+
+		smp_store_release(&feed->hdr->head, head + 1);
+		if (feed_unread(feed) >= feed->threshold)
+			wake_up_interruptible(&feed->wait);
+	}
+}
+
+/*
+ * Records published and not read yet
+ * The reader may write anything in tail, which at worst makes its
+ * ring look full
+ */
+unsigned int feed_unread(struct feed *feed)
+{
+	return READ_ONCE(feed->hdr->head) -
+		smp_load_acquire(&feed->hdr->tail);
+}
+
+/*
+ * The ring of a file is only allocated once it is mapped or subscribed,
+ * a file opened for the control calls alone never needs one
+ */
+int feed_open(struct inode *inode, struct file *file)
+{
+	int errno = 0;
+	struct feed *feed;
+
+	feed = kzalloc(sizeof(struct feed), GFP_KERNEL);
+	if (feed == NULL) {
+		errno = -ENOMEM;
+		goto OUT;
+	}
+
+	feed->threshold = 1;
+	init_waitqueue_head(&feed->wait);
+
+	mutex_lock(&kwatch_mutex);
+	list_add_tail(&feed->list, &feeds);
+	mutex_unlock(&kwatch_mutex);
+
+	file->private_data = feed;
+
+OUT:
+	return errno;
+}
+
+/*
+ * Allocate the ring of a feed, if it has none yet
+ * hdr is set last, poll reads it without the lock
+ * Caller holds kwatch_mutex
+ */
+int feed_ring(struct feed *feed)
+{
+	struct feed_hdr *hdr;
+
+	if (feed->hdr != NULL) {
+		return 0;
+	}
+
+	hdr = vmalloc_user(_FEED_SIZE_);
+	if (hdr == NULL) {
+		return -ENOMEM;
+	}
+
+	hdr->magic = _FEED_MAGIC_;
+	hdr->version = _FEED_VERSION_;
+	hdr->num = _FEED_RECS_;
+	hdr->rec_size = sizeof(struct feed_rec);
+	feed->rec = (struct feed_rec *)((char *)hdr + _FEED_HDR_SIZE_);
+	smp_store_release(&feed->hdr, hdr);
+
+	return 0;
+}
+
+/*
+ * The mapping holds a reference on the file, so the ring is never
+ * freed under the reader
+ */
+int feed_release(struct inode *inode, struct file *file)
+{
+	struct feed *feed = file->private_data;
+
+	mutex_lock(&kwatch_mutex);
+	list_del(&feed->list);
+	if (feed->subscribed)
+		atomic_dec(&num_feeds);
+	mutex_unlock(&kwatch_mutex);
+
+	vfree(feed->hdr);
+	kfree(feed);
+
+	return 0;
+}
+
+/*
+ * The ring is mapped from its start, whole or in part: readers map the
+ * header page alone first, to learn how big the ring is
+ */
+int feed_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct feed *feed = file->private_data;
+	int errno;
+
+	if (vma->vm_pgoff != 0
+			|| vma->vm_end - vma->vm_start > PAGE_ALIGN(_FEED_SIZE_)) {
+		return -EINVAL;
+	}
+
+	mutex_lock(&kwatch_mutex);
+	errno = feed_ring(feed);
+	mutex_unlock(&kwatch_mutex);
+	if (errno < 0) {
+		return errno;
+	}
+
+	return remap_vmalloc_range(vma, feed->hdr, 0);
+}
+
+/*
+ * Besides the feed ioctls, the control calls: sysWatch() and getWatch()
+ * are run for the caller as they were as system calls
+ */
+long feed_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	int errno = -ENOTTY;
+	struct feed *feed = file->private_data;
+	char *kern_dirname = NULL;
+	struct kwatch_key key;
+	struct kwatch_call call;
+	unsigned int threshold;
+
+	if (cmd == _KWATCH_IOC_WATCH_ || cmd == _KWATCH_IOC_GET_) {
+		if (copy_from_user(&call, (void __user *)arg,
+					sizeof(struct kwatch_call))) {
+			errno = -EFAULT;
+			goto OUT;
+		}
+
+		if (cmd == _KWATCH_IOC_WATCH_)
+			errno = my_sys_watch(call.file, call.option);
+		else
+			errno = my_get_watch(call.file, call.buf, call.buf_len);
+
+		goto OUT;
+	}
+
+	if (cmd == _FEED_IOC_THRESHOLD_) {
+		if (get_user(threshold, (unsigned int __user *)arg)) {
+			errno = -EFAULT;
+			goto OUT;
+		}
+
+		if (threshold < 1 || threshold > _FEED_RECS_) {
+			errno = -EINVAL;
+			goto OUT;
+		}
+
+		/* Taken by the merge, which then sees the new value */
+		mutex_lock(&kwatch_mutex);
+		WRITE_ONCE(feed->threshold, threshold);
+		mutex_unlock(&kwatch_mutex);
+		wake_up_interruptible(&feed->wait);
+		errno = 0;
+		goto OUT;
+	}
+
+	if (cmd != _FEED_IOC_WATCH_) {
+		goto OUT;
+	}
+
+	kern_dirname = my_get_from_user((const char *)arg);
+	if (NULL == kern_dirname) {
+		errno = -EFAULT;
+		goto OUT;
+	}
+
+	errno = get_inode(kern_dirname, &key);
+	if (errno < 0) {
+		goto OUT;
+	}
+
+	/* Changes queued before the subscription are not published */
+	mutex_lock(&kwatch_mutex);
+	drain_stages();
+	if (is_stat(&key) == NULL) {
+		errno = -EINVAL;
+	} else {
+		errno = feed_ring(feed);
+	}
+
+	if (errno == 0) {
+		feed->watch = key;
+		if (!feed->subscribed)
+			atomic_inc(&num_feeds);
+
+		feed->subscribed = 1;
+	}
+	mutex_unlock(&kwatch_mutex);
+
+OUT:
+	if (kern_dirname) {
+		kfree(kern_dirname);
+		kern_dirname = NULL;
+	}
+
+	return errno;
+}
+
+/*
+ * Readable once threshold records are unread
+ * The merge wakes us up after publishing a record, the reader moving
+ * tail never does: it only ever makes the file less readable
+ */
+kwatch_poll_t feed_poll(struct file *file, poll_table *wait)
+{
+	struct feed *feed = file->private_data;
+	kwatch_poll_t mask = 0;
+
+	poll_wait(file, &feed->wait, wait);
+
+	/* Without a ring yet there is nothing to read */
+	if (smp_load_acquire(&feed->hdr) == NULL)
+		return mask;
+
+	if (feed_unread(feed) >= READ_ONCE(feed->threshold))
+		mask |= POLLIN | POLLRDNORM;
+
+	return mask;
+}
+
+const struct file_operations feed_fops = {
+	.owner		= THIS_MODULE,
+	.open		= feed_open,
+	.release	= feed_release,
+	.mmap		= feed_mmap,
+	.poll		= feed_poll,
+	.unlocked_ioctl	= feed_ioctl,
+	.llseek		= noop_llseek,
+};
+
+/*
+ * Open to all, as the system calls it stands for were
+ */
+struct miscdevice feed_dev = {
+	.minor		= MISC_DYNAMIC_MINOR,
+	.name		= "kwatch",
+	.fops		= &feed_fops,
+	.mode		= 0666,
+};
+
+/*
+ * Return the key for a particular filename and checks if it is a file or
+ * directory depending on the second parameters value return -errno if
+ * failure returns 0 if success
+ */
+int get_inode(const char *const filename, struct kwatch_key *key)
+{
+	int errno = -EINVAL;
+	struct path path;
+
+	memset(key, 0, sizeof(struct kwatch_key));
+
+	errno = kern_path(filename, LOOKUP_FOLLOW, &path);
+	if (errno) {
+		goto OUT;
+	}
+
+	errno = check_inode(path.dentry->d_inode);
+	if (0 == errno) {
+		/*Take inode number and store */
+		fill_key(path.dentry->d_inode, key);
+	}
+
+	path_put(&path);
+
+OUT:
+	return errno;
+}
+
+/*
+ * Checks if an inode is a file or a directory, which the
+ * current process may read. Returns -errno if not, 0 if so
+ *
+ * Security feature:
+ * Also checks if the current process is the owner of the file
+ */
+int check_inode(struct inode *inode)
+{
+	int errno;
+
+	if (!(S_ISDIR(inode->i_mode) || S_ISREG(inode->i_mode))) {
+		return -EBADF;
+	}
+
+	errno = kwatch_inode_permission(inode, MAY_READ);
+	if (errno) {
+		return errno;
+	}
+
+	/* Check if the I/p file and the process owner match */
+	if ((kwatch_uid() != kwatch_inode_uid(inode))
+			&& (kwatch_uid() != 0)) {
+		return -EACCES;
+	}
+
+	return 0;
+}
+
+
+/*
+ * Takes a file name and checks recursively if any parent of this
+ * file/folder is under watch
+ * Returns 1 and the key of the watch if so, 0 otherwise
+ */
+int check_if_any_parent_is_watched(char *fileName, struct kwatch_key *watch)
+{
+	struct path path;
+	int found = 0;
+
+	if (kern_path(fileName, LOOKUP_FOLLOW, &path)) {
+		goto OUT;
+	}
+
+	found = check_if_any_parent_is_watched_path(&path, watch);
+	path_put(&path);
+
+OUT:
+	return found;
+}
+
+/*
+ * Takes a file ptr and checks if any parent is under watch
+ * Assumes filePtr is a valid file pointer
+ * Returns 1 and the key of the watch if so, 0 otherwise
+ */
+int check_if_any_parent_is_watched_filp(struct file *filePtr,
+					struct kwatch_key *watch)
+{
+	return check_if_any_parent_is_watched_path(&filePtr->f_path, watch);
+}
+
+/*
+ * Same as check_if_any_parent_is_watched_filp, for a looked up path
+ */
+int check_if_any_parent_is_watched_path(struct path *path,
+					struct kwatch_key *watch)
+{
+	return check_if_any_parent_is_watched_cached(path->dentry, watch);
+}
+
+/*
+ * Same as check_if_any_parent_is_watched_dentry, going through
+ * the verdict cache first
+ */
+int check_if_any_parent_is_watched_cached(struct dentry *dentry,
+					struct kwatch_key *watch)
+{
+	unsigned int gen;
+	int found;
+
+	/* Sample the generation before walking, a racing bump wins */
+	gen = atomic_read(&watch_gen);
+	smp_rmb();
+
+	found = lookup_verdict(dentry, gen, watch);
+	if (found >= 0) {
+		return found;
+	}
+
+	/*
+	 * The path filter is part of the verdict, so only run on a miss
+	 * Without memory for it the change can not be told apart from
+	 * a filtered one: the watch it falls under, if any, is rescanned
+	 */
+	found = dentry_path_filter(dentry);
+	if (found < 0) {
+		if (check_if_any_parent_is_watched_dentry(dentry, watch)) {
+			rescan_watch(watch);
+		}
+
+		return 0;
+	}
+
+	if (found) {
+		memset(watch, 0, sizeof(struct kwatch_key));
+		found = 0;
+	} else {
+		found = check_if_any_parent_is_watched_dentry(dentry, watch);
+	}
+
+	store_verdict(dentry, gen, found, watch);
+
+	return found;
+}
+
+/*
+ * path_filter() for a dentry
+ * Returns -errno if the path of the dentry could not be built
+ */
+int dentry_path_filter(struct dentry *dentry)
+{
+	char *path = NULL;
+	char *path_buf = NULL;
+	int ret = 0;
+
+	path_buf = kmalloc(_MAX_PATH_LEN_, GFP_ATOMIC);
+	if (path_buf == NULL) {
+		ret = -ENOMEM;
+		goto OUT;
+	}
+
+	path = dentry_path_raw(dentry, path_buf, _MAX_PATH_LEN_);
+	if (NULL != path && !IS_ERR(path)) {
+		ret = path_filter(path);
+	}
+
+OUT:
+	if (path_buf) {
+		kfree(path_buf);
+		path_buf = NULL;
+	}
+
+	return ret;
+}
+
+/*
+ * Walks up the parents of a dentry looking for a watched directory
+ * Returns 1 and the key of the watch if so, 0 otherwise
+ */
+int check_if_any_parent_is_watched_dentry(struct dentry *dentry,
+					struct kwatch_key *watch)
+{
+	struct head_node *parent = NULL;
+	struct dentry *parentPtr = NULL;
+	struct kwatch_key key;
+	int found = 0;
+
+	/* To Prevent the parent dentry loop from going in an infinite loop */
+	int i = 0;
+
+	memset(watch, 0, sizeof(struct kwatch_key));
+
+	rcu_read_lock();
+
+	/* Get the dentry of the parent of the open file */
+	parentPtr = dentry->d_parent;
+	while (parentPtr != NULL && i < 20) {
+		fill_key(parentPtr->d_inode, &key);
+		parent = is_stat(&key);
+		if (parent != NULL) {
+			*watch = parent->key;
+			found = 1;
+			break;
+		} else if (IS_ROOT(parentPtr)) {
+			break;
+		} else {
+			i++;
+			parentPtr = parentPtr->d_parent;
+		}
+	}
+
+	rcu_read_unlock();
+
+	return found;
+}
+
+/*
+ * Look up the cached verdict of a dentry
+ * Returns -1 on a miss, else what the parent walk returned
+ * The entry must still describe the same dentry: same parent,
+ * same inode and no watch or rename since it was filled
+ */
+int lookup_verdict(struct dentry *dentry, unsigned int gen,
+			struct kwatch_key *watch)
+{
+	struct verdict_ent *ent;
+	int found = -1;
+
+	ent = &get_cpu_var(verdict_caches).ent[hash_ptr(dentry,
+							_VERDICT_BITS_)];
+	if (ent->dentry == dentry && ent->gen == gen
+			&& ent->parent == dentry->d_parent
+			&& ent->inode == dentry->d_inode) {
+		found = ent->found;
+		*watch = ent->watch;
+	}
+
+	put_cpu_var(verdict_caches);
+
+	if (found < 0) {
+		hook_stat_inc(misses);
+	} else {
+		hook_stat_inc(hits);
+	}
+
+	return found;
+}
+
+/*
+ * Remember the verdict of a dentry, computed under generation gen
+ */
+void store_verdict(struct dentry *dentry, unsigned int gen, int found,
+			const struct kwatch_key *watch)
+{
+	struct verdict_ent *ent;
+
+	ent = &get_cpu_var(verdict_caches).ent[hash_ptr(dentry,
+							_VERDICT_BITS_)];
+	ent->dentry = dentry;
+	ent->parent = dentry->d_parent;
+	ent->inode = dentry->d_inode;
+	ent->gen = gen;
+	ent->found = found;
+	ent->watch = *watch;
+
+	put_cpu_var(verdict_caches);
+}
+
+/*
+ * Invalidate every cached verdict
+ */
+void bump_watch_gen(void)
+{
+	smp_wmb();
+	atomic_inc(&watch_gen);
+}
+
+/*
+ * getWatch(): get the buffer of files changed
+ * in a directory
+ * For a file under a watch, gets its changed byte ranges instead
+ * With _GET_PAGED_ in buf_len, the buffer starts with a struct
+ * user_query and is filled a page at a time, see its definition
+ * Records are copied one by one, so the kernel never holds more than
+ * one of them, however large the set
+ */
+int my_get_watch(const char * const file, void *user_buf, int buf_len)
+{
+	int errno = 0;
+	struct head_node *temp_head = NULL;
+	struct kwatch_key key;
+	struct user_query query;
+	struct user_query *paged = NULL;
+	struct path root;
+	void *recs = user_buf;
+	int size = 0;
+	char *kern_file = NULL;
+	int is_paged = buf_len & _GET_PAGED_;
+
+	buf_len &= ~_GET_PAGED_;
+	if (buf_len < 0) {
+		return -EINVAL;
+	}
+
+	errno = kwatch_access_ok(VERIFY_WRITE, user_buf, buf_len);
+	if (!errno) {
+		errno = -EACCES;
+		return errno;
+	}
+
+	/* Only read the header when told it is there */
+	if (is_paged) {
+		if (buf_len < (int)_QUERY_V1_SIZE_) {
+			return -EINVAL;
+		}
+
+		memset(&query, 0, sizeof(query));
+		if (copy_from_user(&query, user_buf, _QUERY_V1_SIZE_)) {
+			return -EFAULT;
+		}
+
+		/* Older callers know nothing past their size */
+		size = query_size(query.version);
+		if (_QUERY_MAGIC_ != query.magic || size == 0 ||
+				size != query.size || buf_len < size) {
+			return -EINVAL;
+		}
+
+		if (copy_from_user(&query, user_buf, size)) {
+			return -EFAULT;
+		}
+
+		size = 0;
+
+		paged = &query;
+		recs = user_buf + query.size;
+		buf_len -= query.size;
+	}
+
+	kern_file = my_get_from_user(file);
+	if (NULL == kern_file) {
+		errno = -EFAULT;
+		return errno;
+	}
+
+	mutex_lock(&kwatch_mutex);
+	drain_stages();
+
+	/* Get the list of directories being watched */
+	if (0 == strncmp(kern_file, _DIR_LIST_, strlen(_DIR_LIST_))) {
+		size = paged ? sizeof(struct user_watch) :
+				sizeof(unsigned long);
+		errno = get_watch_list(recs, buf_len / size, paged);
+	} else {
+		errno = get_inode(kern_file, &key);
+		if (errno < 0) {
+			goto OUT;
+		}
+
+		temp_head = is_stat(&key);
+		if (NULL == temp_head) {
+			/* Not a watch, maybe a file under one */
+			errno = get_extents(kern_file, &key, recs, buf_len,
+						paged);
+		} else {
+			if (paged && (query.flags & _QUERY_SNAPSHOT_)) {
+				temp_head = temp_head->snap;
+				if (NULL == temp_head) {
+					errno = -ENOENT;
+					goto OUT;
+				}
+			} else if (paged && query.consumer &&
+					!(query.flags & _QUERY_MORE_)) {
+				errno = ack_consumer(temp_head, query.consumer,
+							query.since);
+				if (errno < 0) {
+					goto OUT;
+				}
+			}
+
+			if (paged && paged->version >= 4 && (query.flags &
+					(_QUERY_HANDLE_ | _QUERY_PATH_))) {
+				errno = kern_path(kern_file, LOOKUP_FOLLOW,
+							&root);
+				if (errno) {
+					goto OUT;
+				}
+
+				errno = get_records(temp_head, recs, buf_len,
+							paged, &root);
+				path_put(&root);
+			} else if (paged && paged->version >= 4) {
+				errno = get_records(temp_head, recs, buf_len,
+							paged, NULL);
+			} else {
+				size = sizeof(struct user_data_node);
+				errno = get_changes(temp_head, recs,
+						buf_len / size, paged);
+			}
+		}
+	}
+
+	if (errno < 0) {
+		goto OUT;
+	}
+
+	if (paged) {
+		query.count = errno;
+		if (copy_to_user(user_buf, &query, query.size)) {
+			errno = -EFAULT;
+		}
+	} else if (size && clear_user(recs + errno * size,
+				buf_len - errno * size)) {
+		/* The rest of an unpaged buffer is cleared, as it always was */
+		errno = -EFAULT;
+	}
+
+OUT:
+	mutex_unlock(&kwatch_mutex);
+
+	if (kern_file) {
+		kfree(kern_file);
+		kern_file = NULL;
+	}
+
+	return errno;
+}
+
+/*
+ * Size of the query header of a version, 0 if unknown
+ */
+int query_size(unsigned int version)
+{
+	switch (version) {
+	case 1:
+		return _QUERY_V1_SIZE_;
+
+	case 2:
+		return _QUERY_V2_SIZE_;
+
+	case 3:
+		return _QUERY_V3_SIZE_;
+
+	case 4:
+		return _QUERY_V4_SIZE_;
+
+	case _QUERY_VERSION_:
+		return sizeof(struct user_query);
+	}
+
+	return 0;
+}
+
+/*
+ * sysWatch(): lets the user interact with the module
+ */
+int my_sys_watch(const char * const dirname, int option)
+{
+	int errno = -EINVAL;
+	char *kern_dirname = NULL;
+	struct kwatch_key key;
+	unsigned int block_bits;
+	int has_key = 0;
+
+	block_bits = (option >> _BLOCK_BITS_SHIFT_) & _OPTION_MASK_;
+	option &= _OPTION_MASK_;
+
+	if (_NUM_WATCH_ == option) {
+		mutex_lock(&kwatch_mutex);
+		errno = num_watch();
+		mutex_unlock(&kwatch_mutex);
+		goto OUT;
+	}
+
+	/* Check for NULL pointers or invalid values */
+	if (NULL == dirname) {
+		errno = -EINVAL;
+		goto OUT;
+	}
+
+	kern_dirname = my_get_from_user(dirname);
+	if (NULL == kern_dirname) {
+		goto OUT;
+	}
+
+	if (path_filter(kern_dirname)) {
+		errno = -EINVAL;
+		goto OUT;
+	}
+
+	/*
+	 * Pages written from the flush on have to be seen again, the
+	 * mappings of the watch are written back before it, see
+	 * sync_mmap_watches()
+	 */
+	if (_REM_WATCH_ == option || _FLUSH_WATCH_ == option
+			|| _SNAPSHOT_WATCH_ == option) {
+		has_key = (get_inode(kern_dirname, &key) == 0);
+	}
+
+	if (has_key && _REM_WATCH_ != option) {
+		sync_mmap_watches(&key, _MMAP_FLUSH_);
+	}
+
+	/* Pending changes are merged before anything is looked at */
+	mutex_lock(&kwatch_mutex);
+	drain_stages();
+
+	switch (option) {
+	case _SET_WATCH_:
+		errno = set_watch(kern_dirname, block_bits);
+		break;
+
+	case _REM_WATCH_:
+		errno = rem_watch(kern_dirname);
+		break;
+
+	case _NUM_CHANGES_:
+		errno = num_changes(kern_dirname);
+		break;
+
+	case _FLUSH_WATCH_:
+		errno = flush_watch(kern_dirname);
+		break;
+
+	case _NEEDS_RESCAN_:
+		errno = needs_rescan(kern_dirname);
+		break;
+
+	case _SNAPSHOT_WATCH_:
+		errno = snapshot_watch(kern_dirname);
+		break;
+
+	case _ADD_CONSUMER_:
+		errno = add_consumer(kern_dirname);
+		break;
+
+	case _REM_CONSUMER_:
+		errno = rem_consumer(kern_dirname, block_bits);
+		break;
+	}
+
+	mutex_unlock(&kwatch_mutex);
+
+	if (has_key && _REM_WATCH_ == option && errno == 1) {
+		sync_mmap_watches(&key, _MMAP_FORGET_);
+	}
+
+OUT:
+	if (kern_dirname) {
+		kfree(kern_dirname);
+		kern_dirname = NULL;
+	}
+
+	return errno;
+}
+
+/*
+ * Function to set a watch
+ * This will add a handle with the specified inode
+ * Its changes are tracked in chunks of 2^block_bits bytes,
+ * or Block_Size if block_bits is 0
+ */
+int set_watch(const char * const dirname, unsigned int block_bits)
+{
+	int errno = -EINVAL;
+	struct kwatch_key key, watch;
+
+	if (0 == block_bits) {
+		block_bits = ilog2(Block_Size);
+	} else if (block_bits < _BLOCK_BITS_MIN_
+			|| block_bits > _BLOCK_BITS_MAX_) {
+		errno = -EINVAL;
+		goto OUT;
+	}
+
+	errno = get_inode(dirname, &key);
+	if (errno < 0) {
+		goto OUT;
+	}
+
+	if (check_if_any_parent_is_watched((char *)dirname, &watch)) {
+		errno = -EINVAL;
+		goto OUT;
+	}
+
+	errno = set_handle(&key, block_bits);
+
+OUT:
+	return errno;
+}
+
+/*
+ * Function returning the number of watched folder
+ */
+int num_watch(void)
+{
+	int i = 0;
+	struct head_node *temp1 = main_obj->next;
+
+	while (temp1 != NULL) {
+		temp1 = temp1->next;
+		i++;
+	}
+
+	return i;
+}
+
+/*
+ * Gets the number of changes made inside a watched directory
+ */
+int num_changes(const char * const filename)
+{
+	struct kwatch_key key;
+	int errno = 0;
+	struct head_node *temp1 = NULL;
+
+	errno = get_inode(filename, &key);
+
+	if (errno < 0) {
+		goto OUT;
+	}
+
+	temp1 = is_stat(&key);
+	if (temp1 != NULL) {
+		errno = temp1->num_data;
+	}
+
+OUT:
+	return errno;
+}
+
+/*
+ * Tells if changes inside a watched directory were lost since it
+ * was last flushed, in which case it has to be rescanned
+ */
+int needs_rescan(const char * const filename)
+{
+	struct kwatch_key key;
+	int errno = 0;
+	struct head_node *temp1 = NULL;
+
+	errno = get_inode(filename, &key);
+
+	if (errno < 0) {
+		goto OUT;
+	}
+
+	temp1 = is_stat(&key);
+	if (temp1 != NULL) {
+		errno = test_bit(_HEAD_RESCAN_BIT_, &temp1->flags) ? 1 : 0;
+	}
+
+OUT:
+	return errno;
+}
+
+/*
+ * Function to remove the watch from a specified handle
+ */
+int rem_watch(const char * const filename)
+{
+	struct kwatch_key key;
+	int errno = 0;
+	struct head_node *temp1 = NULL;
+	struct head_node *temp2 = NULL;
+	struct head_node **link = NULL;
+	/* Get inode number */
+
+	errno = get_inode(filename, &key);
+
+	if (errno < 0) {
+		goto OUT;
+	}
+
+	/* Check if the inode is under watch*/
+	temp2 = is_stat(&key);
+	if (temp2 == NULL) {
+		goto OUT;
+	}
+
+	/* Unlink it from the hash and from the list of watches */
+	link = &watch_hash[hash_key(&key, _WATCH_HASH_BITS_)];
+	while (*link != temp2)
+		link = &(*link)->hnext;
+
+	rcu_assign_pointer(*link, temp2->hnext);
+
+	temp1 = main_obj;
+	while (temp1->next != temp2)
+		temp1 = temp1->next;
+
+	temp1->next = temp2->next;
+	rem_sb_watch(temp2->key.dev);
+	rem_watch_proc(temp2);
+	bump_watch_gen();
+
+	/*
+	 * Wait for the hooks still walking the hash and drop whatever
+	 * they queued for this watch, before freeing it
+	 */
+	synchronize_rcu();
+	drain_stages();
+
+	retire_changes(temp2->snap);
+	retire_changes(temp2);
+	temp2 = NULL;
+	errno = 1;
+
+OUT:
+	return errno;
+}
+
+/*
+ * Function to flush the watched files for a specified handle
+ */
+int flush_watch(const char * const filename)
+{
+	struct kwatch_key key;
+	int errno = 0;
+	struct head_node *temp2 = NULL;
+	struct head_node *old = NULL;
+	/* Get inode number */
+
+	errno = get_inode(filename, &key);
+
+	if (errno < 0) {
+		goto OUT;
+	}
+
+	/* Check if the inode is under watch*/
+	temp2 = is_stat(&key);
+	if (temp2 != NULL) {
+		old = detach_changes(temp2);
+		if (old != NULL) {
+			retire_changes(old);
+		} else {
+			/* No memory for an empty set, free in place */
+			if (temp2->data != NULL) {
+				cleanup_obj(temp2->data);
+			}
+
+			temp2->data = NULL;
+			temp2->tail = NULL;
+			temp2->num_data = 0;
+			temp2->epoch++;
+			reset_hash(temp2);
+			temp2->mem = sizeof(struct head_node) +
+				(sizeof(struct data_node *) << temp2->hash_bits);
+			clear_bit(_HEAD_RESCAN_BIT_, &temp2->flags);
+		}
+
+		errno = 1;
+	}
+
+OUT:
+	return errno;
+}
+
+/*
+ * Take the changes of a watch off it in one go, for the user to read
+ * with _QUERY_SNAPSHOT_ while new ones go to an empty set. Unlike
+ * reading then flushing, no change can land in between and be lost
+ * The snapshot replaces the previous one, which is freed later
+ * Returns the number of records in it
+ */
+int snapshot_watch(const char * const filename)
+{
+	struct kwatch_key key;
+	int errno = 0;
+	struct head_node *head = NULL;
+	struct head_node *old = NULL;
+
+	errno = get_inode(filename, &key);
+	if (errno < 0) {
+		goto OUT;
+	}
+
+	head = is_stat(&key);
+	if (head == NULL) {
+		goto OUT;
+	}
+
+	old = detach_changes(head);
+	if (old == NULL) {
+		errno = -ENOMEM;
+		goto OUT;
+	}
+
+	retire_changes(head->snap);
+	head->snap = old;
+	errno = old->num_data;
+
+OUT:
+	return errno;
+}
+
+/*
+ * Register a consumer on a watch
+ * It starts from nothing read: until it reads, every record is kept
+ * Returns its id, from 1
+ */
+int add_consumer(const char * const filename)
+{
+	struct kwatch_key key;
+	int errno = 0;
+	struct head_node *head = NULL;
+	unsigned int id;
+
+	errno = get_inode(filename, &key);
+	if (errno < 0) {
+		goto OUT;
+	}
+
+	head = is_stat(&key);
+	if (head == NULL) {
+		errno = -EINVAL;
+		goto OUT;
+	}
+
+	for (id = 0; id < _MAX_CONSUMERS_; id++) {
+		if (!(head->consumers & (1U << id)))
+			break;
+	}
+
+	if (id == _MAX_CONSUMERS_) {
+		errno = -EBUSY;
+		goto OUT;
+	}
+
+	head->consumers |= 1U << id;
+	head->acked[id] = 0;
+	errno = id + 1;
+
+OUT:
+	return errno;
+}
+
+/*
+ * Unregister a consumer, what only it was holding back goes
+ */
+int rem_consumer(const char * const filename, unsigned int id)
+{
+	struct kwatch_key key;
+	int errno = 0;
+	struct head_node *head = NULL;
+
+	errno = get_inode(filename, &key);
+	if (errno < 0) {
+		goto OUT;
+	}
+
+	head = is_stat(&key);
+	if (head == NULL || id < 1 || id > _MAX_CONSUMERS_ ||
+			!(head->consumers & (1U << (id - 1)))) {
+		errno = -EINVAL;
+		goto OUT;
+	}
+
+	head->consumers &= ~(1U << (id - 1));
+	reclaim_acked(head);
+	errno = 1;
+
+OUT:
+	return errno;
+}
+
+/*
+ * A consumer asked for the changes since seq: it is done with those
+ * up to seq. Never goes back
+ * Caller holds kwatch_mutex
+ */
+int ack_consumer(struct head_node *head, unsigned int id,
+			unsigned long long seq)
+{
+	if (id < 1 || id > _MAX_CONSUMERS_ ||
+			!(head->consumers & (1U << (id - 1)))) {
+		return -EINVAL;
+	}
+
+	if (seq > head->seq) {
+		return -EINVAL;
+	}
+
+	if (seq > head->acked[id - 1]) {
+		head->acked[id - 1] = seq;
+		reclaim_acked(head);
+	}
+
+	return 0;
+}
+
+/*
+ * Free the records every registered consumer has read. They are the
+ * oldest ones, at the front of the list. Without consumers, records
+ * are only ever dropped by a flush
+ * Caller holds kwatch_mutex
+ */
+void reclaim_acked(struct head_node *head)
+{
+	struct data_node *node;
+	unsigned long long upto = ~0ULL;
+	int id;
+
+	if (head->consumers == 0)
+		return;
+
+	for (id = 0; id < _MAX_CONSUMERS_; id++) {
+		if ((head->consumers & (1U << id)) && head->acked[id] < upto)
+			upto = head->acked[id];
+	}
+
+	while (head->data != NULL && head->data->seq <= upto) {
+		node = head->data;
+		unlink_data(head, node);
+		unhash_data(head, node);
+		head->num_data--;
+		head->mem -= sizeof(struct data_node);
+		if (node->ext != node->inl_ext) {
+			head->mem -= sizeof(struct extent) * node->max_ext;
+			kfree(node->ext);
+		}
+
+		kmem_cache_free(data_cache, node);
+	}
+}
+
+/*
+ * Move the change set of a watch to a head of its own, and give the
+ * watch an empty one: a few pointers change hands, whatever the number
+ * of records. The epoch moves on, for paged reads of the watch to
+ * notice, and the rescan mark goes with the changes it was set for
+ * Returns NULL if there is no memory for the empty set
+ * Caller holds kwatch_mutex
+ */
+struct head_node *detach_changes(struct head_node *head)
+{
+	struct head_node *old;
+	struct data_node **hash;
+
+	old = kmem_cache_alloc(head_cache, GFP_KERNEL);
+	hash = alloc_hash(_HASH_MIN_BITS_);
+	if (old == NULL || hash == NULL) {
+		if (old)
+			kmem_cache_free(head_cache, old);
+
+		free_hash(hash, _HASH_MIN_BITS_);
+		return NULL;
+	}
+
+	*old = *head;
+	old->next = NULL;
+	old->hnext = NULL;
+	old->snap = NULL;
+	old->consumers = 0;
+
+	head->data = NULL;
+	head->tail = NULL;
+	head->num_data = 0;
+	head->hash = hash;
+	head->hash_bits = _HASH_MIN_BITS_;
+	head->epoch++;
+	head->mem = sizeof(struct head_node) +
+			(sizeof(struct data_node *) << head->hash_bits);
+	clear_bit(_HEAD_RESCAN_BIT_, &head->flags);
+
+	return old;
+}
+
+/*
+ * Hand a change set nobody can reach anymore to reap_work, so that
+ * freeing a large one never holds kwatch_mutex
+ * The lists are only ever walked under kwatch_mutex, never by the
+ * hooks, so once unlinked there is no reader to wait for
+ */
+void retire_changes(struct head_node *old)
+{
+	if (old == NULL)
+		return;
+
+	spin_lock(&reap_lock);
+	old->next = reap_list;
+	reap_list = old;
+	spin_unlock(&reap_lock);
+
+	schedule_work(&reap_work);
+}
+
+/*
+ * Free a change set, with its head
+ */
+void free_changes(struct head_node *old)
+{
+	if (old->data != NULL)
+		cleanup_obj(old->data);
+
+	free_hash(old->hash, old->hash_bits);
+	kmem_cache_free(head_cache, old);
+}
+
+void reap_work_fn(struct work_struct *work)
+{
+	struct head_node *old, *next;
+
+	spin_lock(&reap_lock);
+	old = reap_list;
+	reap_list = NULL;
+	spin_unlock(&reap_lock);
+
+	while (old != NULL) {
+		next = old->next;
+		free_changes(old);
+		old = next;
+	}
+}
+
+
+/*
+ * VFS hooks
+ * Changes are caught with kretprobes on the vfs_* functions which every
+ * system call, io_uring or nfsd request ends up in, once the kernel has
+ * resolved the file or dentry. The entry handler keeps what the return
+ * handler needs in its probe_data, the return handler records the
+ * change if the operation succeeded
+ * Handlers run with preemption disabled and must never sleep
+ */
+
+/*
+ * Argument n of a probed function, read at its entry
+ */
+unsigned long probe_arg(struct pt_regs *regs, int n)
+{
+#ifdef CONFIG_X86_64
+	switch (n) {
+	case 0:
+		return regs->di;
+	case 1:
+		return regs->si;
+	case 2:
+		return regs->dx;
+	case 3:
+		return regs->cx;
+	default:
+		return regs->r8;
+	}
+#else
+	/* regparm(3): the fourth argument onwards is on the stack */
+	switch (n) {
+	case 0:
+		return regs->ax;
+	case 1:
+		return regs->dx;
+	case 2:
+		return regs->cx;
+	default:
+		return regs_get_kernel_stack_nth(regs, n - 2);
+	}
+#endif
+}
+
+/*
+ * Record a change of the inode of a dentry, if it is under a watch
+ */
+void process_dentry(struct dentry *dentry, unsigned long bits,
+			loff_t start, loff_t len)
+{
+	struct kwatch_key watch, key;
+
+	if (0 == atomic_read(&num_watches) || dentry_filter(dentry)) {
+		return;
+	}
+
+	if (check_if_any_parent_is_watched_cached(dentry, &watch)) {
+		fill_key(dentry->d_inode, &key);
+		bits |= kwatch_type_bits(dentry->d_inode);
+		stage_change(&watch, &key, bits, start, len);
+	}
+}
+
+/*
+ * Writes are recorded once they are done, so that a flush or snapshot
+ * which comes in between never misses them
+ * Every way of writing to a file checks its range with rw_verify_area()
+ * inside one of the write paths: write and pwrite, writev and pwritev,
+ * splice and sendfile, copy_file_range, whether it copies or shares the
+ * blocks, and io_uring. The entry of a write path looks its file up,
+ * and only takes a slot for its task if it is under a watch, so that
+ * writes to anything else keep no kretprobe instance. rw_verify_area()
+ * leaves the range with it, and its return records as much of the
+ * range as was written. Write paths run inside one another,
+ * copy_file_range splicing for one, so the slot tells the innermost
+ * and each of them the one it runs inside of
+ */
+
+/*
+ * Slot of the current task, NULL if it is in no write path
+ * Only the task itself fills or empties its slot, the others merely
+ * see that it is taken
+ */
+struct write_slot *find_write_slot(void)
+{
+	struct write_slot *slot;
+	unsigned long bucket;
+	int i;
+
+	bucket = hash_ptr(current, _WRITE_SLOT_BITS_);
+
+	for (i = 0; i < _WRITE_PROBE_; i++) {
+		slot = &write_slots[(bucket + i) &
+				((1 << _WRITE_SLOT_BITS_) - 1)];
+		if (READ_ONCE(slot->task) == current) {
+			return slot;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Enter a write path
+ * Returns -ENOSPC if no slot is left for the task, rw_verify_area()
+ * then records its writes itself, before they are done
+ */
+int push_write(struct probe_data *data)
+{
+	struct write_slot *slot = find_write_slot();
+	unsigned long bucket;
+	int i;
+
+	if (slot != NULL) {
+		data->outer = slot->data;
+		slot->data = data;
+		return 0;
+	}
+
+	bucket = hash_ptr(current, _WRITE_SLOT_BITS_);
+
+	for (i = 0; i < _WRITE_PROBE_; i++) {
+		slot = &write_slots[(bucket + i) &
+				((1 << _WRITE_SLOT_BITS_) - 1)];
+		if (cmpxchg(&slot->task, NULL, current) == NULL) {
+			data->outer = NULL;
+			slot->data = data;
+			return 0;
+		}
+	}
+
+	return -ENOSPC;
+}
+
+/*
+ * Leave a write path, they return in the reverse order they came in
+ */
+void pop_write(struct probe_data *data)
+{
+	struct write_slot *slot = find_write_slot();
+
+	if (slot == NULL || slot->data != data) {
+		return;
+	}
+
+	slot->data = data->outer;
+	if (slot->data == NULL) {
+		smp_store_release(&slot->task, NULL);
+	}
+}
+
+/*
+ * Keep an io_uring write until it completes, with its file looked up
+ * now. A request issued again, as it could not be done without
+ * blocking, keeps the start of its first try, part of it may be written
+ * A slot of the same kiocb for another file, or older than
+ * _ASYNC_WRITE_TTL_, was left by a request cancelled before it
+ * completed, the kiocb being used again since: it is taken over, and
+ * its watch rescanned
+ * 1 - the file is not under watch
+ * -ENOSPC - no slot is left for it
+ */
+int add_async_write(struct kiocb *kiocb, struct file *file, loff_t start,
+			loff_t len)
+{
+	struct dentry *dentry = file->f_path.dentry;
+	struct kwatch_key key, watch;
+	struct async_write *ent;
+	struct kwatch_key stale;
+	unsigned long bucket, flags;
+	unsigned long bits = 0;
 	int errno = 0;
-	struct head_node *temp_head = main_obj->next;
-	struct data_node *temp_data = NULL;
-	unsigned long inode_num;
-	void *temp_ptr = NULL;
-	int found = 0;
-	void *kern_buf = NULL;
-	int num = 0;
-	int size = 0;
-	int i = 0, ret;
-	char getWatDirs = 'N';
+	int i, free = -1;
+	int expired = 0;
 
-	errno = access_ok(VERIFY_WRITE, user_buf, buf_len);
-	if (!errno) {
-		errno = -EACCES;
-		goto OUT;
+	if (dentry_filter(dentry) ||
+		!check_if_any_parent_is_watched_cached(dentry, &watch)) {
+		return 1;
 	}
 
-	/* Get the list of directories being watched */
-	if (0 == strncmp(file, _DIR_LIST_, strlen(_DIR_LIST_))) {
-		getWatDirs = 'Y';
-		size = sizeof(unsigned long);
-	} else {
-		errno = get_inode(file, &inode_num);
-		if (errno < 0) {
-			goto OUT;
-		}
+	fill_key(dentry->d_inode, &key);
+	bits = kwatch_type_bits(dentry->d_inode);
+	set_bit(_FILE_MODIFY_BIT_, &bits);
 
-		while (NULL != temp_head) {
-			if (inode_num == temp_head->inode) {
-				found = 1;
-				break;
-			}
+	bucket = hash_ptr(kiocb, _ASYNC_WRITE_BITS_);
 
-			temp_head = temp_head->next;
+	spin_lock_irqsave(&async_write_lock, flags);
+	for (i = 0; i < _WRITE_PROBE_; i++) {
+		ent = &async_writes[(bucket + i) &
+				((1 << _ASYNC_WRITE_BITS_) - 1)];
+		if (ent->kiocb == kiocb) {
+			free = (bucket + i) & ((1 << _ASYNC_WRITE_BITS_) - 1);
+			break;
 		}
 
-		if (!found) {
-			goto OUT;
+		if (ent->kiocb == NULL && free < 0) {
+			free = (bucket + i) & ((1 << _ASYNC_WRITE_BITS_) - 1);
 		}
-
-		size = sizeof(struct data_node);
 	}
 
-	num = buf_len/size;
-	kern_buf = kmalloc(buf_len, GFP_KERNEL);
-	if (!kern_buf) {
-		errno = -ENOMEM;
+	if (free < 0) {
+		errno = -ENOSPC;
 		goto OUT;
 	}
 
-	memset(kern_buf, _NULL_CHAR_, buf_len);
+	ent = &async_writes[free];
+	if (ent->kiocb == NULL) {
+		atomic_inc(&num_async_writes);
+	} else if (!key_equal(&ent->key, &key) ||
+		time_after(jiffies, ent->stamp + _ASYNC_WRITE_TTL_)) {
+		stale = ent->watch;
+		expired = 1;
+	} else if (ent->start < start) {
+		len = max(ent->start + ent->len, start + len) - ent->start;
+		start = ent->start;
+	}
 
-	if ('N' == getWatDirs) {
-		temp_data = temp_head->data;
-		if (temp_data == NULL) {
-			ret = copy_to_user(user_buf, kern_buf, buf_len);
-			goto OUT;
-		}
+	ent->kiocb = kiocb;
+	ent->stamp = jiffies;
+	ent->bits = bits;
+	ent->start = start;
+	ent->len = len;
+	ent->key = key;
+	ent->watch = watch;
 
-		while ((i < num) && (temp_data != NULL)) {
-			temp_ptr = temp_data;
-			memcpy(kern_buf + size*i, temp_ptr, size);
-			i++;
-			temp_data = temp_data->next;
+OUT:
+	spin_unlock_irqrestore(&async_write_lock, flags);
+
+	if (expired) {
+		rescan_watch(&stale);
+	}
+
+	return errno;
+}
+
+/*
+ * Empty the slots of io_uring writes which never completed, requests
+ * cancelled once queued or before being issued again. Part of them may
+ * be written, so their watches are rescanned
+ * Caller holds kwatch_mutex
+ */
+void expire_async_writes(void)
+{
+	struct async_write *ent;
+	struct kwatch_key watch;
+	unsigned long flags;
+	int i, expired;
+
+	if (0 == atomic_read(&num_async_writes)) {
+		return;
+	}
+
+	for (i = 0; i < (1 << _ASYNC_WRITE_BITS_); i++) {
+		ent = &async_writes[i];
+		expired = 0;
+
+		spin_lock_irqsave(&async_write_lock, flags);
+		if (ent->kiocb != NULL &&
+			time_after(jiffies, ent->stamp + _ASYNC_WRITE_TTL_)) {
+			watch = ent->watch;
+			ent->kiocb = NULL;
+			atomic_dec(&num_async_writes);
+			expired = 1;
 		}
-	} else {
-		while (NULL != temp_head) {
-			*((unsigned long *)kern_buf + i) = temp_head->inode;
-			temp_head = temp_head->next;
-			++i;
+		spin_unlock_irqrestore(&async_write_lock, flags);
+
+		if (expired) {
+			rescan_watch(&watch);
 		}
 	}
+}
 
-	ret = copy_to_user(user_buf, kern_buf, buf_len);
-	errno = i;
+/*
+ * Take the io_uring write of kiocb out of the slots
+ * 1 - found, in ent
+ * 0 - not a write we keep, reads complete the same way
+ */
+int take_async_write(struct kiocb *kiocb, struct async_write *ent)
+{
+	struct async_write *slot;
+	unsigned long bucket, flags;
+	int i, found = 0;
 
-OUT:
-	if (kern_buf) {
-		kfree(kern_buf);
-		kern_buf = NULL;
+	if (0 == atomic_read(&num_async_writes)) {
+		return 0;
 	}
 
-	return errno;
+	bucket = hash_ptr(kiocb, _ASYNC_WRITE_BITS_);
+
+	spin_lock_irqsave(&async_write_lock, flags);
+	for (i = 0; i < _WRITE_PROBE_; i++) {
+		slot = &async_writes[(bucket + i) &
+				((1 << _ASYNC_WRITE_BITS_) - 1)];
+		if (slot->kiocb == kiocb) {
+			*ent = *slot;
+			slot->kiocb = NULL;
+			atomic_dec(&num_async_writes);
+			found = 1;
+			break;
+		}
+	}
+
+	spin_unlock_irqrestore(&async_write_lock, flags);
+	return found;
 }
 
 /*
- * System call for the user to interact with the module
+ * Record the part of [start, start + len) a write got done. A stream
+ * has no range, its len is 0
  */
-asmlinkage int my_sys_watch(const char * const dirname, int option)
+void record_write(struct file *file, loff_t start, loff_t len, long written)
 {
-	int errno = -EINVAL;
-	char *kern_dirname = NULL;
+	unsigned long temp = 0;
 
-	if (_NUM_WATCH_ == option) {
-		errno = num_watch();
-		goto OUT;
+	if (len && written < len) {
+		len = written;
 	}
 
-	/* Check for NULL pointers or invalid values */
-	if (NULL == dirname) {
-		errno = -EINVAL;
-		goto OUT;
+	set_bit(_FILE_MODIFY_BIT_, &temp);
+	process_dentry(file->f_path.dentry, temp, start, len);
+}
+
+/*
+ * rw_verify_area(read_write, file, ppos, count)
+ * Hands the range asked for to the write path it runs inside of. One
+ * outside of them, or of another file, or io_uring when no slot is
+ * left, is recorded here as it used to be, when the range is checked
+ */
+int verify_entry(struct kretprobe_instance *ri, struct pt_regs *regs)
+{
+	struct probe_data *data = (struct probe_data *)ri->data;
+	struct write_slot *slot;
+	struct probe_data *path;
+	struct file *file;
+	loff_t *ppos;
+	loff_t start, len;
+
+	/*
+	 * Negative fast path: reads, nothing is watched, or this write
+	 * would not be recorded anyway
+	 */
+	if (WRITE != (int)probe_arg(regs, 0) ||
+		0 == atomic_read(&num_watches) ||
+		userEuid != kwatch_euid()) {
+		return 1;
 	}
 
-	kern_dirname = my_get_from_user(dirname);
-	if (NULL == kern_dirname) {
-		goto OUT;
+	file = (struct file *)probe_arg(regs, 1);
+	if (file_filter(file)) {
+		return 1;
 	}
 
-	if (path_filter(kern_dirname)) {
-		errno = -EINVAL;
-		goto OUT;
+	ppos = (loff_t *)probe_arg(regs, 2);
+	len = (size_t)probe_arg(regs, 3);
+
+	/*
+	 * An O_APPEND write lands at the end of the file, wherever its
+	 * position is. Streams have no position at all
+	 */
+	if (file->f_flags & O_APPEND) {
+		start = i_size_read(file->f_path.dentry->d_inode);
+	} else if (ppos) {
+		start = *ppos;
+	} else {
+		start = 0;
+		len = 0;
 	}
 
-	switch (option) {
-	case _SET_WATCH_:
-		errno = set_watch(kern_dirname);
-		if (errno < 0) {
-			goto OUT;
-		}
+	slot = find_write_slot();
+	path = slot ? slot->data : NULL;
 
-		if (sys_call_table[__NR_write] != my_sys_write) {
-			orig_sys_write = sys_call_table[__NR_write];
-			sys_call_table[__NR_write] = my_sys_write;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+	/* io_uring gives its position as that of the kiocb */
+	if (path && path->req && ppos) {
+		path->kiocb = container_of(ppos, struct kiocb, ki_pos);
+		if (add_async_write(path->kiocb, file, start, len) >= 0) {
+			path->file = file;
+			return 1;
 		}
+	}
+#endif
 
-		break;
+	if (path && !path->req && path->file == file) {
+		path->start = start;
+		path->len = len;
+		return 1;
+	}
 
-	case _REM_WATCH_:
-		errno = rem_watch(kern_dirname);
-		break;
+	data->file = file;
+	data->start = start;
+	data->len = len;
 
-	case _NUM_CHANGES_:
-		errno = num_changes(kern_dirname);
-		break;
+	return 0;
+}
 
-	case _FLUSH_WATCH_:
-		errno = flush_watch(kern_dirname);
-		break;
+int verify_ret(struct kretprobe_instance *ri, struct pt_regs *regs)
+{
+	struct probe_data *data = (struct probe_data *)ri->data;
+
+	if ((long)regs_return_value(regs) < 0) {
+		return 0;
 	}
 
-OUT:
-	if (kern_dirname) {
-		kfree(kern_dirname);
-		kern_dirname = NULL;
+	record_write(data->file, data->start, data->len, data->len);
+
+	return 0;
+}
+
+/*
+ * Enter a write path of file, if it is under a watch
+ * start stays -1 until rw_verify_area() gives the range
+ */
+int enter_write(struct probe_data *data, struct file *file)
+{
+	struct dentry *dentry;
+
+	if (0 == atomic_read(&num_watches) ||
+		userEuid != kwatch_euid() || file_filter(file)) {
+		return 1;
 	}
 
-	return errno;
+	dentry = file->f_path.dentry;
+	if (!check_if_any_parent_is_watched_cached(dentry, &data->watch)) {
+		return 1;
+	}
+
+	fill_key(dentry->d_inode, &data->key);
+	data->type = kwatch_type_bits(dentry->d_inode);
+	data->file = file;
+	data->start = -1;
+	data->req = NULL;
+
+	/* Out of slots the write goes unseen, so its watch is rescanned */
+	if (push_write(data) < 0) {
+		rescan_watch(&data->watch);
+		return 1;
+	}
+
+	return 0;
 }
 
 /*
- * Function to set a watch
- * This will add a handle with the specified inode
+ * Entry of the write paths which return what they wrote
+ * vfs_write(), vfs_writev(), vfs_iter_write() and do_iter_write()
+ * write to their first argument, do_splice(), do_splice_direct() and
+ * vfs_copy_file_range() to their third
  */
-int set_watch(const char * const dirname)
+int write_entry(struct kretprobe_instance *ri, struct pt_regs *regs)
 {
-	int errno = -EINVAL;
-	unsigned long inode_num, parent_inode;
+	return enter_write((struct probe_data *)ri->data,
+				(struct file *)probe_arg(regs, 0));
+}
 
-	errno = get_inode(dirname, &inode_num);
-	if (errno < 0) {
-		goto OUT;
+int splice_entry(struct kretprobe_instance *ri, struct pt_regs *regs)
+{
+	return enter_write((struct probe_data *)ri->data,
+				(struct file *)probe_arg(regs, 2));
+}
+
+int write_ret(struct kretprobe_instance *ri, struct pt_regs *regs)
+{
+	struct probe_data *data = (struct probe_data *)ri->data;
+	long written = (long)regs_return_value(regs);
+	unsigned long temp = data->type;
+	loff_t len = data->len;
+
+	pop_write(data);
+
+	if (data->start < 0 || written <= 0) {
+		return 0;
 	}
 
-	parent_inode = check_if_any_parent_is_watched((char *)dirname);
-	if (parent_inode > 0) {
-		errno = -EINVAL;
-		goto OUT;
+	/* Only what was written, a stream has no range */
+	if (len && written < len) {
+		len = written;
 	}
 
-	errno = set_handle(inode_num);
+	set_bit(_FILE_MODIFY_BIT_, &temp);
+	stage_change(&data->watch, &data->key, temp, data->start, len);
 
-OUT:
-	return errno;
+	return 0;
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
 /*
- * Function returning the number of watched folder
+ * io_write(req, issue_flags)
+ * io_uring tells what was written in the completion of the request
+ * When io_write() completes it, that is its result, else it is done by
+ * io_complete_rw(kiocb, res), or io_complete_rw_iopoll() on a polled
+ * ring, which may run before io_write() returns. A request which would
+ * block is issued again by a worker, and one which is queued completes
+ * later, both keep their slot of async_writes until then
  */
-int num_watch(void)
+int io_write_entry(struct kretprobe_instance *ri, struct pt_regs *regs)
 {
-	int i = 0;
-	struct head_node *temp1 = main_obj->next;
+	struct probe_data *data = (struct probe_data *)ri->data;
+	struct io_kiocb *req = (struct io_kiocb *)probe_arg(regs, 0);
 
-	while (temp1 != NULL) {
-		temp1 = temp1->next;
-		i++;
+	if (io_complete_hooked != 2 || 0 == atomic_read(&num_watches) ||
+		userEuid != kwatch_euid() ||
+		req->file == NULL || file_filter(req->file)) {
+		return 1;
 	}
 
-	return i;
+	data->file = NULL;
+	data->req = req;
+
+	if (push_write(data) < 0) {
+		if (check_if_any_parent_is_watched_cached(
+				req->file->f_path.dentry, &data->watch)) {
+			rescan_watch(&data->watch);
+		}
+
+		return 1;
+	}
+
+	return 0;
+}
+
+int io_write_ret(struct kretprobe_instance *ri, struct pt_regs *regs)
+{
+	struct probe_data *data = (struct probe_data *)ri->data;
+	struct io_kiocb *req = (struct io_kiocb *)data->req;
+	long ret = (long)regs_return_value(regs);
+	struct async_write ent;
+
+	pop_write(data);
+
+	if (data->file == NULL || -EIOCBQUEUED == ret || -EAGAIN == ret) {
+		return 0;
+	}
+
+	if (take_async_write(data->kiocb, &ent) && 0 == ret &&
+		req->cqe.res > 0) {
+		stage_change(&ent.watch, &ent.key, ent.bits, ent.start,
+				min_t(loff_t, ent.len, req->cqe.res));
+	}
+
+	return 0;
+}
+
+int io_complete_entry(struct kretprobe_instance *ri, struct pt_regs *regs)
+{
+	struct kiocb *kiocb = (struct kiocb *)probe_arg(regs, 0);
+	long res = (long)probe_arg(regs, 1);
+	struct async_write ent;
+
+	if (take_async_write(kiocb, &ent) && res > 0) {
+		stage_change(&ent.watch, &ent.key, ent.bits, ent.start,
+				min_t(loff_t, ent.len, res));
+	}
+
+	return 1;
 }
+#endif
 
 /*
- * Gets the number of changes made inside a watched directory
+ * vfs_fallocate(file, mode, offset, len)
+ * Allocating, punching a hole or zeroing a range all change it
  */
-int num_changes(const char * const filename)
+int fallocate_entry(struct kretprobe_instance *ri, struct pt_regs *regs)
 {
-	unsigned long inode_num = 0;
-	int errno = 0;
-	struct head_node *temp1 = main_obj->next;
+	struct probe_data *data = (struct probe_data *)ri->data;
 
-	errno = get_inode(filename, &inode_num);
+	if (0 == atomic_read(&num_watches) || userEuid != kwatch_euid()) {
+		return 1;
+	}
 
-	if (errno < 0) {
-		goto OUT;
+	data->file = (struct file *)probe_arg(regs, 0);
+#ifdef CONFIG_X86_64
+	data->start = probe_arg(regs, 2);
+	data->len = probe_arg(regs, 3);
+#else
+	/* A 64 bit offset does not fit in the last register left */
+	data->start = regs_get_kernel_stack_nth(regs, 1) |
+			((u64)regs_get_kernel_stack_nth(regs, 2) << 32);
+	data->len = regs_get_kernel_stack_nth(regs, 3) |
+			((u64)regs_get_kernel_stack_nth(regs, 4) << 32);
+#endif
+
+	return file_filter(data->file);
+}
+
+int fallocate_ret(struct kretprobe_instance *ri, struct pt_regs *regs)
+{
+	struct probe_data *data = (struct probe_data *)ri->data;
+	unsigned long temp = 0;
+
+	if (regs_return_value(regs) != 0) {
+		return 0;
 	}
 
-	while (temp1 != NULL) {
-		if (temp1->inode == inode_num) {
-			errno = temp1->num_data;
-			break;
-		}
+	set_bit(_FILE_MODIFY_BIT_, &temp);
+	process_dentry(data->file->f_path.dentry, temp,
+			data->start, data->len);
 
-		temp1 = temp1->next;
+	return 0;
+}
+
+/*
+ * notify_change([idmap,] dentry, attr, ...)
+ * Covers chmod, chown, utimes and truncate, whichever way they came
+ */
+int setattr_entry(struct kretprobe_instance *ri, struct pt_regs *regs)
+{
+	struct probe_data *data = (struct probe_data *)ri->data;
+	struct iattr *attr;
+
+	if (0 == atomic_read(&num_watches)) {
+		return 1;
 	}
 
-OUT:
-	return errno;
+	data->dentry = (struct dentry *)probe_arg(regs, _IDMAP_ARGS_);
+	attr = (struct iattr *)probe_arg(regs, _IDMAP_ARGS_ + 1);
+	data->ia_valid = attr->ia_valid;
+	data->ia_size = attr->ia_size;
+	stat_setattr(data->ia_valid);
+
+	return dentry_filter(data->dentry);
+}
+
+int setattr_ret(struct kretprobe_instance *ri, struct pt_regs *regs)
+{
+	struct probe_data *data = (struct probe_data *)ri->data;
+	unsigned long temp = 0;
+
+	if (regs_return_value(regs) != 0) {
+		return 0;
+	}
+
+	if (data->ia_valid & (ATTR_UID | ATTR_GID)) {
+		set_bit(_FILE_OWNER_BIT_, &temp);
+	}
+
+	if (data->ia_valid & ATTR_MODE) {
+		set_bit(_FILE_MODE_BIT_, &temp);
+	}
+
+	/* Everything from the new length onwards has changed */
+	if (data->ia_valid & ATTR_SIZE) {
+		set_bit(_FILE_MODIFY_BIT_, &temp);
+		process_dentry(data->dentry, temp, data->ia_size, _TO_EOF_);
+		return 0;
+	}
+
+	if (data->ia_valid & (ATTR_ATIME | ATTR_MTIME)) {
+		set_bit(_FILE_TIME_BIT_, &temp);
+	}
+
+	if (temp) {
+		process_dentry(data->dentry, temp, 0, 0);
+	}
+
+	return 0;
 }
 
 /*
- * Function to remove the watch from a specified handle
+ * vfs_unlink([idmap,] dir, dentry, ...) and vfs_rmdir([idmap,] dir, dentry)
+ * The dentry is negative once they return, so its watch is found now
  */
-int rem_watch(const char * const filename)
+int delete_entry(struct kretprobe_instance *ri, struct pt_regs *regs)
 {
-	unsigned long inode_num = 0;
-	int errno = 0;
-	struct head_node *temp1 = NULL;
-	struct head_node *temp2 = NULL;
-	/* Get inode number */
+	struct probe_data *data = (struct probe_data *)ri->data;
+	struct dentry *dentry;
 
-	errno = get_inode(filename, &inode_num);
+	if (0 == atomic_read(&num_watches)) {
+		return 1;
+	}
 
-	if (errno < 0) {
-		goto OUT;
+	dentry = (struct dentry *)probe_arg(regs, _IDMAP_ARGS_ + 1);
+	if (dentry_filter(dentry)) {
+		return 1;
 	}
 
-	/* Check if the inode is under watch*/
-	temp1 = main_obj;
-	temp2 = main_obj->next;
-	while (temp2 != NULL) {
-		if (temp2->inode == inode_num) {
-			if (temp2->data != NULL) {
-				cleanup_obj(temp2->data);
-			}
+	if (!check_if_any_parent_is_watched_cached(dentry, &data->watch)) {
+		return 1;
+	}
 
-			temp1->next = temp2->next;
-			kfree(temp2);
-			temp2 = NULL;
-			errno = 1;
-			break;
-		} else {
-			temp1 = temp2;
-			temp2 = temp2->next;
-		}
+	fill_key(dentry->d_inode, &data->key);
+	data->type = kwatch_type_bits(dentry->d_inode);
+
+	return 0;
+}
+
+int delete_ret(struct kretprobe_instance *ri, struct pt_regs *regs)
+{
+	struct probe_data *data = (struct probe_data *)ri->data;
+	unsigned long temp = data->type;
+
+	if (regs_return_value(regs) == 0) {
+		set_bit(_FILE_DELETE_BIT_, &temp);
+		stage_change(&data->watch, &data->key, temp, 0, 0);
 	}
 
-OUT:
-	return errno;
+	return 0;
 }
 
 /*
- * Function to flush the watched files for a specified handle
+ * vfs_mkdir([idmap,] dir, dentry, mode) and vfs_create(...)
  */
-int flush_watch(const char * const filename)
+int create_entry(struct kretprobe_instance *ri, struct pt_regs *regs)
 {
-	unsigned long inode_num = 0;
-	int errno = 0;
-	struct head_node *temp2 = NULL;
-	/* Get inode number */
+	struct probe_data *data = (struct probe_data *)ri->data;
+	struct inode *dir;
 
-	errno = get_inode(filename, &inode_num);
+	if (0 == atomic_read(&num_watches)) {
+		return 1;
+	}
 
-	if (errno < 0) {
-		goto OUT;
+	/* The dentry is still negative, its directory tells the sb */
+	dir = (struct inode *)probe_arg(regs, _IDMAP_ARGS_);
+	if (!sb_has_watches(dir->i_sb->s_dev)) {
+		return 1;
 	}
 
-	/* Check if the inode is under watch*/
-	temp2 = main_obj->next;
-	while (temp2 != NULL) {
-		if (temp2->inode == inode_num) {
-			if (temp2->data != NULL) {
-				cleanup_obj(temp2->data);
-			}
+	data->dentry = (struct dentry *)probe_arg(regs, _IDMAP_ARGS_ + 1);
 
-			temp2->data = NULL;
-			temp2->num_data = 0;
-			errno = 1;
-			break;
-		} else {
-			temp2 = temp2->next;
-		}
+	return 0;
+}
+
+int create_ret(struct kretprobe_instance *ri, struct pt_regs *regs)
+{
+	struct probe_data *data = (struct probe_data *)ri->data;
+	unsigned long temp = 0;
+
+	if (regs_return_value(regs) == 0) {
+		set_bit(_FILE_CREATE_BIT_, &temp);
+		process_dentry(data->dentry, temp, 0, 0);
+	}
+
+	return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 15, 0)
+/*
+ * vfs_mkdir() returns the dentry of the new directory since 6.15
+ */
+int mkdir_ret(struct kretprobe_instance *ri, struct pt_regs *regs)
+{
+	struct dentry *dentry = (struct dentry *)regs_return_value(regs);
+	unsigned long temp = 0;
+
+	if (!IS_ERR_OR_NULL(dentry)) {
+		set_bit(_FILE_CREATE_BIT_, &temp);
+		process_dentry(dentry, temp, 0, 0);
 	}
 
-OUT:
-	return errno;
+	return 0;
 }
+#else
+#define mkdir_ret				create_ret
+#endif
 
-
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0)
 /*
- * Intercept utimensat()
+ * vfs_open(path, file)
+ * open(O_CREAT) stopped going through vfs_create(), the file
+ * tells whether it was created instead
  */
-asmlinkage long my_sys_utimensat(int dfd, const char __user *filename,
-					struct timespec __user *utimes,
-					int flags)
+int open_entry(struct kretprobe_instance *ri, struct pt_regs *regs)
 {
-	long errno = -EINVAL;
-	int temp[4] = _NULL_BIT_;
+	struct probe_data *data = (struct probe_data *)ri->data;
+	struct path *path;
 
-	errno = (*orig_sys_utimensat)(dfd, filename, utimes, flags);
+	if (0 == atomic_read(&num_watches)) {
+		return 1;
+	}
 
-	if (errno < 0) {
-		goto OUT;
+	/*
+	 * Most opens create nothing, and keep no instance: the file was
+	 * created by the lookup, before vfs_open() is called
+	 */
+	data->file = (struct file *)probe_arg(regs, 1);
+	if (!(data->file->f_mode & FMODE_CREATED)) {
+		return 1;
 	}
 
-	set_bit(_FILE_TIME_BIT_, (void *)&temp);
-	process_file_name(filename, temp);
+	path = (struct path *)probe_arg(regs, 0);
 
-OUT:
-	return errno;
+	return dentry_filter(path->dentry);
 }
 
-
-/*
- * Intercept utimes()
- */
-asmlinkage long my_sys_utimes(char __user *filename,
-					struct timeval __user *times)
+int open_ret(struct kretprobe_instance *ri, struct pt_regs *regs)
 {
-	long errno;
-	int temp[4] = _NULL_BIT_;
+	struct probe_data *data = (struct probe_data *)ri->data;
+	unsigned long temp = 0;
 
-	errno = orig_sys_utimes(filename, times);
-	if (errno < 0) {
-		goto OUT;
+	if (regs_return_value(regs) == 0
+			&& (data->file->f_mode & FMODE_CREATED)) {
+		set_bit(_FILE_CREATE_BIT_, &temp);
+		process_dentry(data->file->f_path.dentry, temp, 0, 0);
 	}
 
-	set_bit(_FILE_TIME_BIT_, (void *)&temp);
-	process_file_name(filename, temp);
-
-OUT:
-	return errno;
+	return 0;
 }
+#endif
 
 /*
- * Intercept open()
+ * vfs_rename(old_dir, old_dentry, new_dir, new_dentry, ...), or
+ * vfs_rename(renamedata) since 5.12
+ * old_dentry carries the new name once the rename is done
  */
-asmlinkage long my_sys_open(const char __user *filename,
-					int flags, int mode)
+int rename_entry(struct kretprobe_instance *ri, struct pt_regs *regs)
 {
-	long errno;
-	int ret = 0;
-	int temp[4] = _NULL_BIT_;
-	ret = orig_sys_access(filename, _MY_MODE_);
-
-	errno = orig_sys_open(filename, flags, mode);
+	struct probe_data *data = (struct probe_data *)ri->data;
 
-	if (errno < 0) {
-		goto OUT;
+	if (0 == atomic_read(&num_watches)) {
+		return 1;
 	}
 
-	if (mode || O_EXCL) {
-		set_bit(_FILE_CREATE_BIT_, (void *)&temp);
-		process_file_name(filename, temp);
-		goto OUT;
-	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+	data->dentry = ((struct renamedata *)probe_arg(regs, 0))->old_dentry;
+#else
+	data->dentry = (struct dentry *)probe_arg(regs, 1);
+#endif
 
-	if (mode || O_CREAT) {
-		if (ret < 0) {
-			set_bit(_FILE_CREATE_BIT_, (void *)&temp);
-			process_file_name(filename, temp);
-			goto OUT;
-		}
-	}
+	return dentry_filter(data->dentry);
+}
 
-	if (mode || O_TRUNC) {
-		set_bit(_FILE_CREATE_BIT_, (void *)&temp);
-		process_file_name(filename, temp);
-		goto OUT;
+int rename_ret(struct kretprobe_instance *ri, struct pt_regs *regs)
+{
+	struct probe_data *data = (struct probe_data *)ri->data;
+	unsigned long temp = 0;
+
+	if (regs_return_value(regs) != 0) {
+		return 0;
 	}
 
-OUT:
-	return errno;
+	/* A directory may have moved in or out of a watch */
+	bump_watch_gen();
+
+	set_bit(_FILE_RENAME_BIT_, &temp);
+	process_dentry(data->dentry, temp, 0, 0);
+
+	return 0;
 }
 
 /*
- * Intercept write()
+ * mmap_region(file, addr, len, [flags,] vm_flags, pgoff, ...)
+ * Entry only. Remembers shared mappings of watched files which may be
+ * written to, mprotect() can not make the others writable later
  */
-asmlinkage long my_sys_write(unsigned int fd, const char __user *buf,
-					size_t count)
+int mmap_entry(struct kretprobe_instance *ri, struct pt_regs *regs)
 {
-	long errno = 0;
-	struct file *filp = NULL;
-	int change_start = 0, change_end = 0;
-	int temp[4] = _NULL_BIT_;
-	int i;
-	filp = fget(fd);
-
-	if (!filp) {
-		filp = NULL;
-	} else {
-		change_start = filp->f_pos;
-		change_start /= Block_Size;
-		change_end = filp->f_pos + count;
-		change_end /= Block_Size;
+	struct file *file;
+	struct dentry *dentry;
+	struct kwatch_key watch, key;
+	unsigned long vm_flags;
+	unsigned long temp = 0;
+
+	if (0 == atomic_read(&num_watches) || userEuid != kwatch_euid()) {
+		return 1;
 	}
 
-	errno = orig_sys_write(fd, buf, count);
-	if (errno < 0) {
-		goto OUT;
+	file = (struct file *)probe_arg(regs, 0);
+	vm_flags = probe_arg(regs, _MMAP_VM_FLAGS_ARG_);
+	if (file == NULL ||
+		(vm_flags & (VM_SHARED | VM_MAYWRITE)) !=
+			(VM_SHARED | VM_MAYWRITE) ||
+		file_filter(file)) {
+		return 1;
 	}
 
-	if (!filp) {
-		goto OUT;
-	} else {
-		fput(filp);
-		filp = NULL;
-		if (userEuid == current->real_cred->euid) {
-			set_bit(_FILE_MODIFY_BIT_, (void *)&temp);
-			if (change_start + _CHANGE_OFFSET_ > _CHANGE_MAX_) {
-				change_start = _FILE_REST_;
-			} else {
-				change_start = change_start + _CHANGE_OFFSET_;
-			}
-
-			if (change_end + _CHANGE_OFFSET_ > _CHANGE_MAX_) {
-				change_end = _FILE_REST_;
-			} else {
-				change_end = change_end + _CHANGE_OFFSET_;
-			}
-
-			for (i = change_start; i <= change_end; i++)
-				set_bit(i, (void *)&temp);
-
-			process_file_desc(fd, temp);
-		}
+	dentry = file->f_path.dentry;
+	if (!check_if_any_parent_is_watched_cached(dentry, &watch)) {
+		return 1;
 	}
 
-OUT:
-	if (filp) {
-		fput(filp);
-		filp = NULL;
+	fill_key(dentry->d_inode, &key);
+	if (add_mmap_watch(file, &key, &watch) < 0) {
+		printk_ratelimited(KERN_WARNING "kWatch: too many mappings, "
+			"recording the whole file %lu\n", key.ino);
+		temp = kwatch_type_bits(dentry->d_inode);
+		set_bit(_FILE_MODIFY_BIT_, &temp);
+		set_bit(_FILE_MMAP_BIT, &temp);
+		stage_change(&watch, &key, temp, 0, _TO_EOF_);
 	}
 
-	return errno;
+	return 1;
 }
 
 /*
- * Intercept rmdir()
+ * folio_mark_dirty(folio) or set_page_dirty(page)
+ * Entry only. A page of a shared mapping is dirtied when it is first
+ * written to after having been written back. Pages dirtied by write()
+ * never come here, those are already recorded
  */
-asmlinkage long my_sys_rmdir(const char __user *pathname)
+int dirty_entry(struct kretprobe_instance *ri, struct pt_regs *regs)
 {
-	int errno = -EINVAL;
-	unsigned long inodeNum = 0, inodeParent = 0;
-	char *kern_pathname = NULL;
-	int ret;
-	int temp[4] = _NULL_BIT_;
-
-	if (NULL == pathname) {
-		goto OUT;
+	struct address_space *mapping;
+	struct kwatch_key watch, key;
+	loff_t start, len;
+	unsigned long temp = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+	struct folio *folio;
+
+	if (0 == atomic_read(&num_mmaps)) {
+		return 1;
 	}
 
-	kern_pathname = my_get_from_user(pathname);
-	if (kern_pathname != NULL) {
-		if (path_filter(kern_pathname) == 0) {
-			ret = get_inode(kern_pathname, &inodeNum);
-			if (ret == 0) {
-				inodeParent = check_if_any_parent_is_watched(kern_pathname);
-			}
-		}
-	}
+	folio = (struct folio *)probe_arg(regs, 0);
+	mapping = folio->mapping;
+	start = (loff_t)folio->index << PAGE_SHIFT;
+	len = folio_size(folio);
+#else
+	struct page *page;
 
-	errno = orig_sys_rmdir(pathname);
-	if (errno < 0) {
-		goto OUT;
+	if (0 == atomic_read(&num_mmaps)) {
+		return 1;
 	}
 
-	if (inodeParent > 0) {
-		set_bit(_FILE_DELETE_BIT_, (void *)&temp);
-		add_data_to_obj(inodeParent, inodeNum, temp);
-	}
+	page = compound_head((struct page *)probe_arg(regs, 0));
+	mapping = page->mapping;
+	start = (loff_t)page->index << PAGE_SHIFT;
+	len = PAGE_SIZE << compound_order(page);
+#endif
 
-OUT:
-	if (kern_pathname) {
-		kfree(kern_pathname);
-		kern_pathname = NULL;
+	if (mapping == NULL || !find_mmap_watch(mapping, &key, &watch)) {
+		return 1;
 	}
 
-	return errno;
+	temp = kwatch_type_bits(mapping->host);
+	set_bit(_FILE_MODIFY_BIT_, &temp);
+	set_bit(_FILE_MMAP_BIT, &temp);
+	stage_change(&watch, &key, temp, start, len);
+
+	return 1;
 }
 
 /*
- * Intercept mkdir()
+ * The probes, registered in this order by init_module()
  */
-asmlinkage long my_sys_mkdir(const char __user *pathname, umode_t mode)
-{
-	long errno = 0;
-	int temp[4] = _NULL_BIT_;
-	errno = orig_sys_mkdir(pathname, mode);
+struct kretprobe kwatch_probes[] = {
+	{
+		.kp.symbol_name	= "rw_verify_area",
+		.entry_handler	= verify_entry,
+		.handler	= verify_ret,
+	},
+	{
+		.kp.symbol_name	= "vfs_write",
+		.entry_handler	= write_entry,
+		.handler	= write_ret,
+	},
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+	{
+		.kp.symbol_name	= "vfs_writev",
+		.entry_handler	= write_entry,
+		.handler	= write_ret,
+	},
+	{
+		.kp.symbol_name	= "vfs_iter_write",
+		.entry_handler	= write_entry,
+		.handler	= write_ret,
+	},
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+	{
+		.kp.symbol_name	= "do_iter_write",
+		.entry_handler	= write_entry,
+		.handler	= write_ret,
+	},
+#else
+	{
+		.kp.symbol_name	= "vfs_writev",
+		.entry_handler	= write_entry,
+		.handler	= write_ret,
+	},
+#endif
+	{
+		.kp.symbol_name	= "do_splice",
+		.entry_handler	= splice_entry,
+		.handler	= write_ret,
+	},
+	{
+		.kp.symbol_name	= "do_splice_direct",
+		.entry_handler	= splice_entry,
+		.handler	= write_ret,
+	},
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+	{
+		.kp.symbol_name	= "vfs_copy_file_range",
+		.entry_handler	= splice_entry,
+		.handler	= write_ret,
+	},
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+	{
+		.kp.symbol_name	= "io_complete_rw",
+		.entry_handler	= io_complete_entry,
+	},
+	{
+		.kp.symbol_name	= "io_complete_rw_iopoll",
+		.entry_handler	= io_complete_entry,
+	},
+	{
+		.kp.symbol_name	= "io_write",
+		.entry_handler	= io_write_entry,
+		.handler	= io_write_ret,
+	},
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
+	{
+		.kp.symbol_name	= "vfs_fallocate",
+		.entry_handler	= fallocate_entry,
+		.handler	= fallocate_ret,
+	},
+#else
+	{
+		.kp.symbol_name	= "do_fallocate",
+		.entry_handler	= fallocate_entry,
+		.handler	= fallocate_ret,
+	},
+#endif
+	{
+		.kp.symbol_name	= "notify_change",
+		.entry_handler	= setattr_entry,
+		.handler	= setattr_ret,
+	},
+	{
+		.kp.symbol_name	= "vfs_unlink",
+		.entry_handler	= delete_entry,
+		.handler	= delete_ret,
+	},
+	{
+		.kp.symbol_name	= "vfs_rmdir",
+		.entry_handler	= delete_entry,
+		.handler	= delete_ret,
+	},
+	{
+		.kp.symbol_name	= "vfs_mkdir",
+		.entry_handler	= create_entry,
+		.handler	= mkdir_ret,
+	},
+	{
+		.kp.symbol_name	= "vfs_create",
+		.entry_handler	= create_entry,
+		.handler	= create_ret,
+	},
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0)
+	{
+		.kp.symbol_name	= "vfs_open",
+		.entry_handler	= open_entry,
+		.handler	= open_ret,
+	},
+#endif
+	{
+		.kp.symbol_name	= "vfs_rename",
+		.entry_handler	= rename_entry,
+		.handler	= rename_ret,
+	},
+	{
+		.kp.symbol_name	= "mmap_region",
+		.entry_handler	= mmap_entry,
+	},
+	{
+		.kp.symbol_name	= _DIRTY_SYMBOL_,
+		.entry_handler	= dirty_entry,
+	},
+};
+
+#define _NUM_PROBES_	(sizeof(kwatch_probes) / sizeof(kwatch_probes[0]))
 
-	if (errno < 0) {
-		goto OUT;
+/*
+ * The write paths need not all be there, some are static and may be
+ * inlined, and io_uring may be left out of the kernel
+ */
+int write_path_probe(int hook)
+{
+	if (hook_entry[hook] == write_entry ||
+		hook_entry[hook] == splice_entry) {
+		return 1;
 	}
 
-	set_bit(_FILE_CREATE_BIT_, (void *)&temp);
-	process_file_name(pathname, temp);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+	if (hook_entry[hook] == io_write_entry ||
+		hook_entry[hook] == io_complete_entry) {
+		return 1;
+	}
+#endif
 
-OUT:
-	return errno;
+	return 0;
 }
 
 /*
- * Intercepted unlink
+ * A hook which found none of its instances free, or fired inside
+ * another one, lost a change, and there is no telling of which watch:
+ * all of them have to be rescanned
+ * Caller holds kwatch_mutex
  */
-asmlinkage long my_sys_unlink(const char __user *pathname)
+void check_missed(void)
 {
-	int ret = 0;
-	long errno = -EINVAL;
-	unsigned long inodeNum = 0, inodeParent = 0;
-	int temp[4] = _NULL_BIT_;
-	char *kern_pathname = NULL;
-
-	if (NULL == pathname) {
-		goto OUT;
-	}
+	struct head_node *head;
+	unsigned long missed = 0;
+	int i;
 
-	kern_pathname = my_get_from_user(pathname);
-	if (kern_pathname != NULL) {
-		if (path_filter(kern_pathname) == 0) {
-			ret = get_inode(kern_pathname, &inodeNum);
-			if (ret == 0) {
-				inodeParent = check_if_any_parent_is_watched(kern_pathname);
-			}
+	for (i = 0; i < _NUM_PROBES_; i++) {
+		if (test_bit(i, probes_hooked)) {
+			missed += READ_ONCE(kwatch_probes[i].nmissed) +
+				READ_ONCE(kwatch_probes[i].kp.nmissed);
 		}
 	}
 
-	errno = orig_sys_unlink(pathname);
-	if (errno < 0) {
-		goto OUT;
+	if (missed == probes_missed) {
+		return;
 	}
 
-	if (inodeParent > 0) {
-		if (0 <= ret) {
-			set_bit(_FILE_DELETE_BIT_, (void *)&temp);
-			add_data_to_obj(inodeParent, inodeNum, temp);
-		}
+	probes_missed = missed;
+	for (head = main_obj->next; head != NULL; head = head->next) {
+		set_bit(_HEAD_RESCAN_BIT_, &head->flags);
 	}
 
-OUT:
-	if (kern_pathname) {
-		kfree(kern_pathname);
-		kern_pathname = NULL;
-	}
-	return errno;
+	printk_ratelimited(KERN_WARNING
+		"kWatch: hooks missed %lu calls, every watch needs a rescan\n",
+		missed);
 }
 
 /*
- * Intercept truncate()
+ * Hook statistics
+ * Every probe goes through stat_entry() and stat_ret(), which call its
+ * real handlers from hook_entry and hook_ret. Once switched on with
+ * debugfs/kwatch/enable, they count the calls and time the handlers,
+ * and cur_hook tells the counters inside which hook they run for. The
+ * cost of a call is the time spent in both of its handlers, kept in
+ * probe_data in between. debugfs/kwatch/stats shows it all
  */
-asmlinkage long my_sys_truncate(const char __user *path, long length)
+void stat_time(int hook, u64 ns)
 {
-	long  errno;
-	int temp[4] = _NULL_BIT_;
-	int len = length;
-	int change_start;
-	int change_end;
-	int i;
+	int bucket = fls64(ns);
 
-	errno = orig_sys_truncate(path, length);
-	if (errno < 0) {
-		goto OUT;
-	}
-
-	change_start = len/Block_Size;
-	if (change_start + _CHANGE_OFFSET_ > _CHANGE_MAX_) {
-		change_start = _FILE_REST_;
-	} else {
-		change_start = change_start + _CHANGE_OFFSET_;
-	}
-
-	change_end = _FILE_REST_;
-	for (i = change_start; i < change_end; i++) {
-		set_bit(i, (void *)&temp);
+	if (bucket >= _HIST_BUCKETS_) {
+		bucket = _HIST_BUCKETS_ - 1;
 	}
 
-	set_bit(_FILE_MODIFY_BIT_ , (void *)&temp);
-	process_file_name(path, temp);
-
-OUT:
-	return errno;
+	this_cpu_inc(hook_stats[hook].hist[bucket]);
 }
 
 /*
- * Intercept ftruncate()
+ * chmod, chown, truncate and utimes all come as notify_change()
  */
-asmlinkage long my_sys_ftruncate(unsigned int fd, unsigned long length)
+void stat_setattr(unsigned int ia_valid)
 {
-	long errno;
-	int change_start, change_end;
-	int i;
-	int temp[4] = _NULL_BIT_;
-	int len = length;
-
-	errno = orig_sys_ftruncate(fd, length);
-	if (errno < 0) {
-		goto OUT;
+	if (!kwatch_stats_on()) {
+		return;
 	}
 
-	change_start = len/Block_Size;
-	if (change_start + _CHANGE_OFFSET_ > _CHANGE_MAX_) {
-		change_start = _FILE_REST_;
+	if (ia_valid & ATTR_SIZE) {
+		this_cpu_inc(setattr_kinds[_SETATTR_TRUNCATE_]);
+	} else if (ia_valid & (ATTR_UID | ATTR_GID)) {
+		this_cpu_inc(setattr_kinds[_SETATTR_CHOWN_]);
+	} else if (ia_valid & ATTR_MODE) {
+		this_cpu_inc(setattr_kinds[_SETATTR_CHMOD_]);
 	} else {
-		change_start = change_start + _CHANGE_OFFSET_;
+		this_cpu_inc(setattr_kinds[_SETATTR_UTIMES_]);
 	}
+}
+
+int stat_entry(struct kretprobe_instance *ri, struct pt_regs *regs)
+{
+	struct probe_data *data = (struct probe_data *)ri->data;
+	int hook = kwatch_ri_probe(ri) - kwatch_probes;
+	unsigned long staged;
+	u64 start;
+	int ret;
 
-	change_end = _FILE_REST_;
-	for (i = change_start; i < change_end; i++) {
-		set_bit(i, (void *)&temp);
+	if (!kwatch_stats_on()) {
+		data->cost = 0;
+		return hook_entry[hook](ri, regs);
 	}
 
-	set_bit(_FILE_MODIFY_BIT_, (void *)&temp);
-	process_file_desc(fd, temp);
+	start = local_clock();
+	__this_cpu_write(cur_hook, hook);
+	staged = __this_cpu_read(hook_stats[hook].staged);
 
-OUT:
-	return errno;
-}
+	ret = hook_entry[hook](ri, regs);
 
-/*
- * Intercept rename()
- */
-asmlinkage long my_sys_rename(const char __user *oldname,
-					const char __user *newname)
-{
-	long errno;
-	int temp[4] = _NULL_BIT_;
+	__this_cpu_write(cur_hook, -1);
+	data->cost = local_clock() - start;
+	this_cpu_inc(hook_stats[hook].calls);
 
-	errno = orig_sys_rename(oldname, newname);
-	if (errno < 0) {
-		goto OUT;
-	}
+	/*
+	 * Entry only hooks always return 1, they were filtered if they
+	 * queued nothing. Otherwise the call ends here if the return
+	 * handler is not wanted
+	 */
+	if (hook_ret[hook] == NULL) {
+		if (staged == __this_cpu_read(hook_stats[hook].staged)) {
+			this_cpu_inc(hook_stats[hook].filtered);
+		}
 
-	set_bit(_FILE_RENAME_BIT_, (void *)&temp);
-	process_file_name(newname, temp);
+		stat_time(hook, data->cost);
+	} else if (ret) {
+		this_cpu_inc(hook_stats[hook].filtered);
+		stat_time(hook, data->cost);
+	}
 
-OUT:
-	return errno;
+	return ret;
 }
 
-/*
- * Intercept chmod()
- */
-asmlinkage long my_sys_chmod(const char __user *filename, mode_t mode)
+int stat_ret(struct kretprobe_instance *ri, struct pt_regs *regs)
 {
-	long errno;
-	int temp[4] = _NULL_BIT_;
+	struct probe_data *data = (struct probe_data *)ri->data;
+	int hook = kwatch_ri_probe(ri) - kwatch_probes;
+	u64 start;
+	int ret;
 
-	errno = orig_sys_chmod(filename, mode);
-	if (errno < 0) {
-		goto OUT;
+	if (!kwatch_stats_on()) {
+		return hook_ret[hook](ri, regs);
 	}
 
-	set_bit(_FILE_MODE_BIT_, (void *)&temp);
-	process_file_name(filename, temp);
+	start = local_clock();
+	__this_cpu_write(cur_hook, hook);
 
-OUT:
-	return errno;
+	ret = hook_ret[hook](ri, regs);
+
+	__this_cpu_write(cur_hook, -1);
+	stat_time(hook, data->cost + local_clock() - start);
+
+	return ret;
 }
 
-/*
- * Intercept fchmod()
- */
-asmlinkage long my_sys_fchmod(unsigned int fd, mode_t mode)
+int stats_show(struct seq_file *m, void *v)
 {
-	long errno;
-	int temp[4] = _NULL_BIT_;
+	struct hook_stats sum;
+	struct hook_stats *st;
+	unsigned long kinds[_SETATTR_KINDS_];
+	int cpu, i, j;
+
+	seq_printf(m, "%-22s %12s %12s %12s %12s %12s\n", "hook", "calls",
+			"filtered", "staged", "cache_hits", "cache_misses");
+
+	for (i = 0; i < _NUM_PROBES_; i++) {
+		memset(&sum, 0, sizeof(sum));
+		for_each_possible_cpu(cpu) {
+			st = &per_cpu(hook_stats[i], cpu);
+			sum.calls += st->calls;
+			sum.filtered += st->filtered;
+			sum.staged += st->staged;
+			sum.hits += st->hits;
+			sum.misses += st->misses;
+			for (j = 0; j < _HIST_BUCKETS_; j++)
+				sum.hist[j] += st->hist[j];
+		}
 
-	errno = orig_sys_fchmod(fd, mode);
-	if (errno < 0) {
-		goto OUT;
+		seq_printf(m, "%-22s %12lu %12lu %12lu %12lu %12lu\n",
+				kwatch_probes[i].kp.symbol_name, sum.calls,
+				sum.filtered, sum.staged, sum.hits,
+				sum.misses);
+
+		/* Bucket j holds the calls which took less than 2^j ns */
+		seq_puts(m, "  ns");
+		for (j = 0; j < _HIST_BUCKETS_; j++) {
+			if (sum.hist[j])
+				seq_printf(m, " <%llu:%lu", 1ULL << j,
+						sum.hist[j]);
+		}
+		seq_puts(m, "\n");
 	}
 
-	set_bit(_FILE_MODE_BIT_, (void *)&temp);
-	process_file_desc(fd, temp);
+	memset(kinds, 0, sizeof(kinds));
+	for_each_possible_cpu(cpu) {
+		for (j = 0; j < _SETATTR_KINDS_; j++)
+			kinds[j] += per_cpu(setattr_kinds[j], cpu);
+	}
 
-OUT:
-	return errno;
+	seq_printf(m, "notify_change    chmod %lu chown %lu truncate %lu "
+			"utimes %lu\n", kinds[_SETATTR_CHMOD_],
+			kinds[_SETATTR_CHOWN_], kinds[_SETATTR_TRUNCATE_],
+			kinds[_SETATTR_UTIMES_]);
+	seq_printf(m, "records          created %lu merged %lu\n",
+			records_created, records_merged);
+	seq_printf(m, "stage ring       dropped %d\n",
+			atomic_read(&stage_drops));
+
+	return 0;
 }
 
-/*
- * Intercept fchown()
- */
-asmlinkage long my_sys_fchown(unsigned int fd, uid_t user, gid_t group)
+int stats_open(struct inode *inode, struct file *file)
 {
-	long errno;
-	int temp[4] = _NULL_BIT_;
+	return single_open(file, stats_show, NULL);
+}
 
-	errno = orig_sys_fchown(fd, user, group);
-	if (errno < 0) {
-		goto OUT;
-	}
+ssize_t stats_enable_read(struct file *file, char __user *buf,
+				size_t len, loff_t *ppos)
+{
+	char tmp[4];
+	int n;
 
-	set_bit(_FILE_OWNER_BIT_, (void *)&temp);
-	process_file_desc(fd, temp);
+	n = scnprintf(tmp, sizeof(tmp), "%d\n", kwatch_stats_on() ? 1 : 0);
 
-OUT:
-	return errno;
+	return simple_read_from_buffer(buf, len, ppos, tmp, n);
 }
 
 /*
- * Have overwritten chown32 as that is the one which is called
- * for this architecture
+ * Writing 1 clears the hook statistics and starts counting, 0 stops
  */
-asmlinkage long my_sys_chown(const char __user *filename,
-				uid_t user, gid_t group)
+ssize_t stats_enable_write(struct file *file, const char __user *buf,
+				size_t len, loff_t *ppos)
 {
-	long errno;
-	int temp[4] = _NULL_BIT_;
+	unsigned int on;
+	int errno;
+	int cpu;
 
-	errno = orig_sys_chown(filename, user, group);
+	errno = kstrtouint_from_user(buf, len, 0, &on);
 	if (errno < 0) {
-		goto OUT;
+		return errno;
 	}
 
-	set_bit(_FILE_OWNER_BIT_, (void *)&temp);
-	process_file_name(filename, temp);
+	if (on && !kwatch_stats_on()) {
+		for_each_possible_cpu(cpu) {
+			memset(per_cpu(hook_stats, cpu), 0,
+				sizeof(struct hook_stats) * _MAX_HOOKS_);
+			memset(per_cpu(setattr_kinds, cpu), 0,
+				sizeof(unsigned long) * _SETATTR_KINDS_);
+		}
+	}
 
-OUT:
-	return errno;
+	kwatch_stats_set(on != 0);
+
+	return len;
 }
 
+const struct file_operations stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+const struct file_operations stats_enable_fops = {
+	.owner		= THIS_MODULE,
+	.read		= stats_enable_read,
+	.write		= stats_enable_write,
+	.llseek		= default_llseek,
+};
+
 /*
  * Init module
  * Open log file, if in debug mode
- * Intercept system calls
  * Initialise main obj
+ * Hook the VFS and register /dev/kwatch
  */
 int init_module(void)
 {
 	int errno = 0;
+	int cpu, i;
 /*
 	filePtr = filp_open(_LOG_FILE_, O_WRONLY | O_TRUNC | O_CREAT, 0666);
 	if (!filePtr || IS_ERR(filePtr)) {
@@ -1278,79 +4608,144 @@ int init_module(void)
 
 	filePtr->f_pos = 0;
 */
-	/* Store the pointer to the original system calls */
-	orig_sys_access = sys_call_table[__NR_access];
-	orig_sys_write = NULL;
-
-	orig_sys_watch = sys_call_table[__NR_sys_watch];
-	sys_call_table[__NR_sys_watch] = my_sys_watch;
-
-	orig_get_watch = sys_call_table[__NR_sys_get_watch];
-	sys_call_table[__NR_sys_get_watch] = my_get_watch;
-
-	orig_sys_utimensat = sys_call_table[__NR_utimensat];
-	sys_call_table[__NR_utimensat] = my_sys_utimensat;
-
-	orig_sys_utimes = sys_call_table[__NR_utimes];
-	sys_call_table[__NR_utimes] = my_sys_utimes;
-
-	orig_sys_unlink = sys_call_table[__NR_unlink];
-	sys_call_table[__NR_unlink] = my_sys_unlink;
-
-	orig_sys_rmdir = sys_call_table[__NR_rmdir];
-	sys_call_table[__NR_rmdir] = my_sys_rmdir;
-
-	orig_sys_truncate = sys_call_table[__NR_truncate];
-	sys_call_table[__NR_truncate] = my_sys_truncate;
-
-	orig_sys_mkdir = sys_call_table[__NR_mkdir];
-	sys_call_table[__NR_mkdir] = my_sys_mkdir;
-
-	orig_sys_ftruncate = sys_call_table[__NR_ftruncate];
-	sys_call_table[__NR_ftruncate] = my_sys_ftruncate;
-
-	orig_sys_rename = sys_call_table[__NR_rename];
-	sys_call_table[__NR_rename] = my_sys_rename;
-
-	orig_sys_fchown = sys_call_table[__NR_fchown];
-	sys_call_table[__NR_fchown] = my_sys_fchown;
-
-	orig_sys_fchmod = sys_call_table[__NR_fchmod];
-	sys_call_table[__NR_fchmod] = my_sys_fchmod;
-
-	orig_sys_chmod = sys_call_table[__NR_chmod];
-	sys_call_table[__NR_chmod] = my_sys_chmod;
-
-	orig_sys_chown = sys_call_table[__NR_chown32];
-	sys_call_table[__NR_chown32] = my_sys_chown;
-
-	orig_sys_open = sys_call_table[__NR_open];
-	sys_call_table[__NR_open] = my_sys_open;
+	/*
+	 * Create the node caches before any call can reach us
+	 */
+	data_cache = kmem_cache_create("kwatch_data_node",
+					sizeof(struct data_node), 0, 0, NULL);
+	head_cache = kmem_cache_create("kwatch_head_node",
+					sizeof(struct head_node), 0, 0, NULL);
+	if (data_cache == NULL || head_cache == NULL) {
+		errno = -ENOMEM;
+		goto OUT;
+	}
 
 	/*
 	 * We are now initialising from blank
 	 * Later take the values from a saved file
 	 * and fill up our data structures
 	 */
-	main_obj = kmalloc(sizeof(struct head_node), GFP_KERNEL);
+	main_obj = kmem_cache_alloc(head_cache, GFP_KERNEL);
 	if (main_obj == NULL) {
 		errno = -ENOMEM;
 		goto OUT;
 	}
 
-	main_obj->inode = -1;
+	memset(&main_obj->key, 0, sizeof(struct kwatch_key));
+	main_obj->key.ino = -1;
 	main_obj->next = NULL;
 	main_obj->data = NULL;
+	main_obj->tail = NULL;
+	main_obj->hash = NULL;
+	main_obj->hash_bits = 0;
+	main_obj->block_bits = 0;
+	main_obj->flags = 0;
+	main_obj->snap = NULL;
+	main_obj->seq = 0;
+	main_obj->consumers = 0;
 
 	userEuid = 0;
 	Block_Size = 16*1024;
 
+	for_each_possible_cpu(cpu) {
+		per_cpu(stage_rings, cpu).head = 0;
+		per_cpu(stage_rings, cpu).tail = 0;
+	}
+
+	/*
+	 * Hook the VFS first, the calls only come in once /dev/kwatch
+	 * is registered, last
+	 */
+	BUILD_BUG_ON(_NUM_PROBES_ > _MAX_HOOKS_);
+	for (i = 0; i < _NUM_PROBES_; i++) {
+		hook_entry[i] = kwatch_probes[i].entry_handler;
+		hook_ret[i] = kwatch_probes[i].handler;
+		kwatch_probes[i].entry_handler = stat_entry;
+		if (hook_ret[i] != NULL)
+			kwatch_probes[i].handler = stat_ret;
+
+		kwatch_probes[i].data_size = sizeof(struct probe_data);
+		kwatch_probes[i].maxactive = max_t(int, _PROBE_MAXACTIVE_,
+				_PROBE_MAXACTIVE_CPU_ * num_possible_cpus());
+		errno = register_kretprobe(&kwatch_probes[i]);
+		if (errno < 0 && write_path_probe(i)) {
+			/* rw_verify_area() records its writes instead */
+			printk(KERN_WARNING "kWatch: can not hook %s: %d\n",
+				kwatch_probes[i].kp.symbol_name, errno);
+			errno = 0;
+			continue;
+		}
+
+		if (errno < 0) {
+			printk(KERN_ALERT "kWatch: can not hook %s: %d\n",
+				kwatch_probes[i].kp.symbol_name, errno);
+			while (i-- > 0)
+				if (test_bit(i, probes_hooked))
+					unregister_kretprobe(&kwatch_probes[i]);
+
+			goto OUT;
+		}
+
+		set_bit(i, probes_hooked);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+		if (hook_entry[i] == io_complete_entry)
+			io_complete_hooked++;
+#endif
+	}
+
+	/*
+	 * Hook and watch statistics are only a help, the module works
+	 * without debugfs or proc
+	 */
+	proc_dir = proc_mkdir("kwatch", NULL);
+
+	stats_dir = debugfs_create_dir("kwatch", NULL);
+	if (!IS_ERR_OR_NULL(stats_dir)) {
+		debugfs_create_file("stats", 0400, stats_dir, NULL,
+					&stats_fops);
+		debugfs_create_file("enable", 0600, stats_dir, NULL,
+					&stats_enable_fops);
+	}
+
+	/*
+	 * But /dev/kwatch is the only way in: sysWatch() and getWatch()
+	 * are its ioctls
+	 */
+	errno = misc_register(&feed_dev);
+	if (errno < 0) {
+		printk(KERN_ALERT "kWatch: no /dev/kwatch: %d\n", errno);
+		for (i = 0; i < _NUM_PROBES_; i++)
+			if (test_bit(i, probes_hooked))
+				unregister_kretprobe(&kwatch_probes[i]);
+
+		if (!IS_ERR_OR_NULL(stats_dir))
+			debugfs_remove_recursive(stats_dir);
+
+		if (proc_dir)
+			remove_proc_entry("kwatch", NULL);
+	}
+
 OUT:
 	if (errno < 0) {
 		if (filePtr) {
 			filp_close(filePtr, NULL);
 			filePtr = NULL;
 		}
+
+		if (main_obj) {
+			kmem_cache_free(head_cache, main_obj);
+			main_obj = NULL;
+		}
+
+		if (head_cache) {
+			kmem_cache_destroy(head_cache);
+			head_cache = NULL;
+		}
+
+		if (data_cache) {
+			kmem_cache_destroy(data_cache);
+			data_cache = NULL;
+		}
 	}
 
 	return errno;
@@ -1367,8 +4762,12 @@ void cleanup_obj(struct data_node *head)
 	while (temp1 != NULL) {
 		temp2 = temp1;
 		temp1 = temp1->next;
-		kfree(temp2);
+		if (temp2->ext != temp2->inl_ext)
+			kfree(temp2->ext);
+
+		kmem_cache_free(data_cache, temp2);
 		temp2 = NULL;
+		cond_resched();
 	}
 }
 
@@ -1387,113 +4786,77 @@ void cleanup_head(void)
 		temp2 = temp1;
 		temp1 = temp1->next;
 
-		kfree(temp2);
+		if (temp2 != main_obj)
+			rem_watch_proc(temp2);
+
+		if (temp2->snap != NULL)
+			free_changes(temp2->snap);
+
+		free_hash(temp2->hash, temp2->hash_bits);
+		kmem_cache_free(head_cache, temp2);
 		temp2 = NULL;
 	}
 }
 
 /*	Cleanup the module
  * 	- free up the used memory
- *	- check if the currently installed system call matches with ours
- *	- if yes, then replace it else report it
+ *	- deregister /dev/kwatch and unhook the VFS
  */
 void cleanup_module(void)
 {
-	/*
-	 * Free up the memory used so far
-	 */
-	cleanup_head();
-	main_obj = NULL;
-
-	/*
-	 * Reset the system call pointers
-	 */
-	if (sys_call_table[__NR_utimensat] != my_sys_utimensat)
-		printk(KERN_ALERT "sys_utimensat() overwritten.");
-	else
-		sys_call_table[__NR_utimensat] = orig_sys_utimensat;
-
-	if (sys_call_table[__NR_utimes] != my_sys_utimes)
-		printk(KERN_ALERT "sys_utimes() overwritten.");
-	else
-		sys_call_table[__NR_utimes] = orig_sys_utimes;
-
-	if (sys_call_table[__NR_sys_watch] != my_sys_watch)
-		printk(KERN_ALERT "sys_watch() system call overwritten.");
-	else
-		sys_call_table[__NR_sys_watch] = orig_sys_watch;
-
-	if (sys_call_table[__NR_sys_get_watch] != my_get_watch)
-		printk(KERN_ALERT "get_watch() system call overwritten.");
-	else
-		sys_call_table[__NR_sys_get_watch] = orig_get_watch;
+	int i;
 
-	if (sys_call_table[__NR_unlink] != my_sys_unlink)
-		printk(KERN_ALERT "sys_unlink() overwritten.");
-	else
-		sys_call_table[__NR_unlink] = orig_sys_unlink;
+	/* No file can be open on the device while the module is in use */
+	misc_deregister(&feed_dev);
 
-	if (sys_call_table[__NR_rmdir] != my_sys_rmdir)
-		printk(KERN_ALERT "sys_rmdir() overwritten.");
-	else
-		sys_call_table[__NR_rmdir] = orig_sys_rmdir;
+	if (!IS_ERR_OR_NULL(stats_dir))
+		debugfs_remove_recursive(stats_dir);
 
-	if (orig_sys_write) {
-		if ((sys_call_table[__NR_write] != my_sys_write))
-			printk(KERN_ALERT "sys_write() overwritten.");
-		else
-			sys_call_table[__NR_write] = orig_sys_write;
+	/*
+	 * Unhook the VFS, then wait for the merges they scheduled
+	 */
+	for (i = 0; i < _NUM_PROBES_; i++) {
+		if (!test_bit(i, probes_hooked))
+			continue;
+
+		unregister_kretprobe(&kwatch_probes[i]);
+		if (kwatch_probes[i].nmissed)
+			printk(KERN_WARNING "kWatch: %s missed %d calls\n",
+				kwatch_probes[i].kp.symbol_name,
+				kwatch_probes[i].nmissed);
 	}
 
-	if (sys_call_table[__NR_truncate] != my_sys_truncate)
-		printk(KERN_ALERT "sys_truncate() overwritten.");
-	else
-		sys_call_table[__NR_truncate] = orig_sys_truncate;
-
-	if (sys_call_table[__NR_ftruncate] != my_sys_ftruncate)
-		printk(KERN_ALERT "sys_ftruncate() overwritten.");
-	else
-		sys_call_table[__NR_ftruncate] = orig_sys_ftruncate;
-
-	if (sys_call_table[__NR_rename] != my_sys_rename)
-		printk(KERN_ALERT "sys_rename() overwritten.");
-	else
-		sys_call_table[__NR_rename] = orig_sys_rename;
-
-	if (sys_call_table[__NR_fchmod] != my_sys_fchmod)
-		printk(KERN_ALERT "sys_fchmod() overwritten.");
-	else
-		sys_call_table[__NR_fchmod] = orig_sys_fchmod;
-
-	if (sys_call_table[__NR_chmod] != my_sys_chmod)
-		printk(KERN_ALERT "sys_chmod() overwritten.");
-	else
-		sys_call_table[__NR_chmod] = orig_sys_chmod;
-
-	if (sys_call_table[__NR_mkdir] != my_sys_mkdir)
-		printk(KERN_ALERT "sys_mkdir() overwritten.");
-	else
-		sys_call_table[__NR_mkdir] = orig_sys_mkdir;
-
-	if (sys_call_table[__NR_fchown] != my_sys_fchown)
-		printk(KERN_ALERT "sys_fchown() overwritten.");
-	else
-		sys_call_table[__NR_fchown] = orig_sys_fchown;
-
-	if (sys_call_table[__NR_chown32] != my_sys_chown)
-		printk(KERN_ALERT "sys_chown() overwritten.");
-	else
-		sys_call_table[__NR_chown32] = orig_sys_chown;
+	cancel_work_sync(&merge_work);
+	cancel_delayed_work_sync(&mmap_prune_work);
+	sync_mmap_watches(NULL, _MMAP_FORGET_);
+	if (atomic_read(&stage_drops))
+		printk(KERN_WARNING "kWatch: %d changes dropped, "
+			"their watches were marked for rescan\n",
+			atomic_read(&stage_drops));
 
-	if (sys_call_table[__NR_open] != my_sys_open)
-		printk(KERN_ALERT "sys_open() overwritten.");
-	else
-		sys_call_table[__NR_open] = orig_sys_open;
 /*
 	if (filePtr) {
 		filp_close(filePtr, NULL);
 		filePtr = NULL;
 	}
 */
+	/*
+	 * Free up the memory used so far, now that no hook can touch it
+	 */
+	cleanup_head();
+	main_obj = NULL;
+
+	/* Whatever was retired and not freed yet */
+	cancel_work_sync(&reap_work);
+	reap_work_fn(NULL);
+
+	if (proc_dir)
+		remove_proc_entry("kwatch", NULL);
+
+	kmem_cache_destroy(data_cache);
+	kmem_cache_destroy(head_cache);
+	data_cache = NULL;
+	head_cache = NULL;
+
 	userEuid = 0;
 }
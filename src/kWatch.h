@@ -29,6 +29,32 @@
 #include <linux/uaccess.h>
 #include <linux/fdtable.h>
 #include <linux/spinlock.h>
+#include <linux/hash.h>
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
+#include <linux/log2.h>
+#include <linux/kprobes.h>
+#include <linux/version.h>
+#include <linux/workqueue.h>
+#include <linux/ratelimit.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/jump_label.h>
+#include <linux/proc_fs.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/ioctl.h>
+#include <linux/exportfs.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+#include <linux/sched/clock.h>
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+#include <linux/io_uring_types.h>
+#endif
+
+#include "kWatchUser.h"
 
 /*
  * Include appropriate Module information
@@ -41,46 +67,28 @@ MODULE_DESCRIPTION("Encryption/Decryption Module");
 /*
  * Declare required constants
  */
-/*
- * Type of Watch
- */
-#define _SET_WATCH_				0
-#define _REM_WATCH_				1
-#define _NUM_CHANGES_			2
-#define _NUM_WATCH_				3
-#define _FLUSH_WATCH_			4
-
 /*
  * File Type
  */
 #define _MY_MODE_				0
 
+
 /*
- * Change Type
+ * The change bits of a file also hold its type, as the S_IFMT bits of
+ * its mode, above the change types. A file never changes type
  */
-#define _FILE_MODIFY_BIT_		0
-#define _FILE_RENAME_BIT_		1
-#define _FILE_DELETE_BIT_		2
-#define _FILE_CREATE_BIT_		3
-#define _FILE_OWNER_BIT_		4
-#define _FILE_MODE_BIT_			5
-#define _FILE_TIME_BIT_			6
-#define _FILE_MMAP_BIT			7
-#define _CHANGE_MIN_			8
-#define _CHANGE_MAX_			126
-#define _FILE_REST_				127
-#define _CHANGE_OFFSET_			8
+#define kwatch_type_bits(inode)	((unsigned long)((inode)->i_mode & S_IFMT))
 
 /*
- * Constant for getting watched directories list
+ * Length of a change running up to the end of the file
  */
-#define _DIR_LIST_				"@#"
+#define _TO_EOF_				(-1LL)
+
 
 /*
  * Module Log File Name
  */
 #define _LOG_FILE_				"kWatch.log"
-#define _NULL_BIT_				{0, 0, 0, 0}
 
 /*
  * Block Size and Bit Array Length, to block certain paths
@@ -97,217 +105,674 @@ MODULE_DESCRIPTION("Encryption/Decryption Module");
 #define _MAX_PATH_LEN_			300
 #define _NULL_CHAR_				'0'
 
+/*
+ * Inode hash kept per watch, next to the list of changes
+ * Starts with 2^_HASH_MIN_BITS_ buckets and doubles whenever
+ * the average chain grows beyond _HASH_MAX_LOAD_ nodes
+ */
+#define _HASH_MIN_BITS_			4
+#define _HASH_MAX_BITS_			20
+#define _HASH_MAX_LOAD_			2
+
+/*
+ * Number of bits of the hash of watched directories
+ */
+#define _WATCH_HASH_BITS_		8
+
+/*
+ * Identity of a file: the inode number alone collides across file
+ * systems, and the generation tells a reused inode number apart from
+ * the file which had it before. Packed in two words on 64 bit
+ */
+struct kwatch_key {
+	unsigned long ino;
+	u32 dev;
+	u32 gen;
+};
+
+/*
+ * Changed chunks of a file are kept as sorted, disjoint [start, end]
+ * ranges of chunks of its watch, end being _EXTENT_EOF_ for a range
+ * running up to the end of the file
+ * The first _INLINE_EXTENTS_ ranges live in the data node, more go to
+ * an array growing up to _MAX_EXTENTS_ ranges. Past that the two
+ * closest ranges are merged: a file costs bounded memory whatever its
+ * size, only the precision degrades
+ */
+#define _INLINE_EXTENTS_		2
+#define _EXTENT_EOF_			(~0UL)
+
+struct extent {
+	unsigned long start;
+	unsigned long end;
+};
+
 /*
  * The data node which will maintain a list of inodes
  * of all the changes inside a watched folder
+ * bits holds the change type bits, ext the changed chunks
+ * seq is the sequence number of the watch when the file last changed
+ * A changing node moves to the tail, so the list is sorted by seq
  */
 struct data_node {
-	unsigned long inode;
-	int bMap[4];
+	struct kwatch_key key;
+	unsigned long bits;
+	unsigned long long seq;
 	struct data_node *next;
+	struct data_node *prev;
+	struct data_node *hnext;
+	struct extent *ext;
+	int num_ext;
+	int max_ext;
+	struct extent inl_ext[_INLINE_EXTENTS_];
 };
 
+
 /*
  * The head node which will mantain a list of all watched folder
+ * Heads are also chained in watch_hash by key through hnext
+ * data/tail keep the changes in the order they were first seen,
+ * hash indexes the same nodes by key
+ * Changes are tracked in chunks of 2^block_bits bytes
+ * epoch counts the flushes, for paged reads to notice them
+ * mem is the memory held by the watch. events counts the changes
+ * merged into it, coalesced those which found their file already
+ * recorded, last_event is the jiffies of the latest one. Both counts
+ * survive a flush
+ * snap holds the changes taken off the watch by its last snapshot, in
+ * a head of their own which is never published
+ * seq is the last sequence number given to a change, it never goes
+ * back, not even on a flush. consumers has a bit per consumer, acked
+ * the sequence number each one has read up to
  */
 struct head_node {
-	unsigned long inode;
+	struct kwatch_key key;
 	struct data_node *data;
 	struct head_node *next;
+	struct head_node __rcu *hnext;
 	int num_data;
+	struct data_node *tail;
+	struct data_node **hash;
+	unsigned int hash_bits;
+	unsigned int block_bits;
+	unsigned long flags;
+	unsigned int epoch;
+	unsigned long mem;
+	unsigned long events;
+	unsigned long coalesced;
+	unsigned long last_event;
+	struct head_node *snap;
+	unsigned long long seq;
+	unsigned int consumers;
+	unsigned long long acked[_MAX_CONSUMERS_];
 } *main_obj;
 
-/*	Declare pointers to the original system calls.
-	-	The reason we keep them, rather than call the original function
-		(sys_XXXX), is because somebody else might have replaced the
-		system call before us. Note that this is not 100% safe, because
-		if another module replaced sys_open before us, then when we're
-		inserted we'll call the function in that module and it might be
-		removed before we are
-	-	Another reason for this is that we can't get sys_XXXX as they
-		are static variables, so they are not exported
+/*
+ * Bits of head_node.flags
+ * RESCAN is set when a change under the watch had to be dropped, its
+ * list of changes is not complete until the next flush
  */
-asmlinkage int
-(*orig_sys_watch)	(const char * const file,
-					int option);
+#define _HEAD_RESCAN_BIT_		0
 
-asmlinkage int
-(*orig_get_watch)	(const char * const file,
-					void *user_buf,
-					int buf_len);
-
-asmlinkage long
-(*orig_sys_utimensat)	(int dfd,
-						const char __user *filename,
-						struct timespec __user *utimes,
-						int flags);
+/*
+ * Number of changes each CPU can queue before they are merged
+ * Must be a power of 2
+ */
+#define _STAGE_LEN_				128
 
-asmlinkage long
-(*orig_sys_utimes)	(char __user *filename,
-					struct timeval __user *utimes);
+/*
+ * A change queued by a hook, waiting to be merged in its watch
+ * state tells whether later changes may still be added to it, see
+ * coalesce_stage()
+ */
+#define _STAGE_OPEN_			0
+#define _STAGE_BUSY_			1
+#define _STAGE_TAKEN_			2
+
+struct stage_rec {
+	struct kwatch_key watch;
+	struct kwatch_key key;
+	unsigned long bits;
+	loff_t start;
+	loff_t len;
+	unsigned long stamp;
+	unsigned int state;
+};
+
+/*
+ * Per CPU ring of queued changes
+ * Only the hooks running on its CPU add to it, and only the merge,
+ * under kwatch_mutex, takes from it: head is written by the former,
+ * tail by the latter, so neither needs a lock. Both only ever grow,
+ * rec is indexed by their low bits
+ * The newest record is also written by its hooks while it is open,
+ * the merge closes it before copying it out
+ */
+struct stage_ring {
+	unsigned int head;
+	unsigned int tail;
+	struct stage_rec rec[_STAGE_LEN_];
+};
 
-asmlinkage long
-(*orig_sys_write)	(unsigned int fd,
-					const char __user *buf,
-					size_t count);
+/*
+ * Number of bits of the per CPU verdict cache
+ */
+#define _VERDICT_BITS_			8
 
-asmlinkage long
-(*orig_sys_unlink)	(const char __user *pathname);
+/*
+ * Cached result of the parent walk for one dentry
+ * parent and inode guard against the dentry being reused
+ */
+struct verdict_ent {
+	struct dentry *dentry;
+	struct dentry *parent;
+	struct inode *inode;
+	unsigned int gen;
+	int found;
+	struct kwatch_key watch;
+};
 
-asmlinkage long
-(*orig_sys_truncate)(const char __user *path,
-					long length);
+struct verdict_cache {
+	struct verdict_ent ent[1 << _VERDICT_BITS_];
+};
+
+/*
+ * Number of file systems tracked by the negative fast path
+ * Watches on more file systems than this disable it
+ */
+#define _SB_WATCH_MAX_			16
+
+/*
+ * Number of watches set on a file system
+ */
+struct sb_watch {
+	dev_t dev;
+	int count;
+};
+
+/*
+ * Shared writable mappings of watched files, found by their
+ * address_space when one of their pages is dirtied
+ * A mapping is looked up in the _MMAP_PROBE_ slots following its hash.
+ * One finding them all in use is recorded as changed as a whole,
+ * once, instead
+ */
+#define _MMAP_WATCH_BITS_		8
+#define _MMAP_PROBE_			8
 
-asmlinkage long
-(*orig_sys_ftruncate)	(unsigned int fd,
-						unsigned long length);
+/*
+ * Modes of sync_mmap_watches()
+ * PRUNE forgets the mappings no longer in use, FLUSH writes the others
+ * back too, FORGET forgets them all
+ * It goes through _MMAP_BATCH_ of them at a time, and mmap_prune_work
+ * prunes them every _MMAP_PRUNE_DELAY_ while there are any
+ */
+#define _MMAP_PRUNE_			0
+#define _MMAP_FLUSH_			1
+#define _MMAP_FORGET_			2
+#define _MMAP_BATCH_			16
+#define _MMAP_PRUNE_DELAY_		(5 * HZ)
 
-asmlinkage long
-(*orig_sys_rename)	(const char __user *oldname,
-					const char __user *newname);
+/*
+ * inode is held, so that mapping stays the same file until the slot
+ * is emptied, and mnt, so that its file system can not be unmounted
+ * under it. seq is odd while the slot is being filled or emptied
+ */
+struct mmap_watch {
+	struct address_space *mapping;
+	struct inode *inode;
+	struct vfsmount *mnt;
+	unsigned int seq;
+	struct kwatch_key key;
+	struct kwatch_key watch;
+};
 
-asmlinkage long
-(*orig_sys_fchmod)	(unsigned int fd,
-					mode_t mode);
+/*
+ * Writes in progress, see write_entry()
+ * A task inside one of the write paths holds the slot of the
+ * _WRITE_PROBE_ following its hash which tells the innermost of them
+ */
+#define _WRITE_SLOT_BITS_		10
+#define _WRITE_PROBE_			8
 
-asmlinkage long
-(*orig_sys_fchown)	(unsigned int fd,
-					uid_t user,
-					gid_t group);
+struct write_slot {
+	struct task_struct *task;
+	struct probe_data *data;
+};
 
-asmlinkage long
-(*orig_sys_rmdir)	(const char __user *pathname);
+/*
+ * io_uring writes which complete after io_write() returned, found by
+ * their kiocb. The file was looked up when it was checked, so that the
+ * completion, which may come in an interrupt, only has to queue it
+ * A slot still there after _ASYNC_WRITE_TTL_ belongs to a cancelled
+ * request, see expire_async_writes()
+ */
+#define _ASYNC_WRITE_BITS_		8
+#define _ASYNC_WRITE_TTL_		(30 * HZ)
+
+struct async_write {
+	struct kiocb *kiocb;
+	unsigned long stamp;
+	unsigned long bits;
+	loff_t start;
+	loff_t len;
+	struct kwatch_key key;
+	struct kwatch_key watch;
+};
 
-asmlinkage long
-(*orig_sys_chmod)	(const char __user *filename,
-					mode_t mode);
+/*
+ * sysWatch() and getWatch(), run by the ioctls of /dev/kwatch
+ * Nothing goes through sys_call_table: the module needs neither a
+ * patched kernel nor system call numbers of its own, changes are
+ * caught at the VFS layer, see the VFS hooks in kWatch.c
+ */
+int my_sys_watch(const char * const dirname, int option);
+int my_get_watch(const char * const file, void *user_buf, int buf_len);
 
-asmlinkage long
-(*orig_sys_chown)	(const char __user *filename,
-					uid_t user,
-					gid_t group);
+/*
+ * Number of calls each VFS hook can track at once, per possible CPU
+ * and at least. The write paths sleep on I/O with theirs held, so
+ * there are more than the 2 per CPU kretprobes take by default
+ */
+#define _PROBE_MAXACTIVE_		64
+#define _PROBE_MAXACTIVE_CPU_	4
 
-asmlinkage long
-(*orig_sys_open)	(const char __user *filename,
-					int flags,
-					int mode);
+/*
+ * Arguments of the vfs_* functions are shifted by the idmap
+ * (or user namespace) of the mount they came with since 5.12
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+#define _IDMAP_ARGS_			1
+#else
+#define _IDMAP_ARGS_			0
+#endif
 
-asmlinkage long
-(*orig_sys_access)	(const char __user *filename,
-					int mode);
+/*
+ * inode_permission() takes the idmap of the mount since 6.3, its user
+ * namespace from 5.12. We check inodes as the filesystem sees them
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+#define kwatch_inode_permission(inode, mask)			\
+	inode_permission(&nop_mnt_idmap, inode, mask)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+#define kwatch_inode_permission(inode, mask)			\
+	inode_permission(&init_user_ns, inode, mask)
+#else
+#define kwatch_inode_permission(inode, mask)			\
+	inode_permission(inode, mask)
+#endif
 
-asmlinkage long
-(*orig_sys_mkdir)	(const char __user *pathname,
-					umode_t mode);
+/*
+ * access_ok() lost its first argument, VERIFY_READ or VERIFY_WRITE,
+ * in 5.0
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+#define kwatch_access_ok(type, addr, size)	access_ok(addr, size)
+#else
+#define kwatch_access_ok(type, addr, size)	access_ok(type, addr, size)
+#endif
 
 /*
- * System calls created for module
+ * READ_ONCE() came in 3.19 and WRITE_ONCE() in 4.0, ACCESS_ONCE()
+ * which they replace went away in 4.15
  */
-asmlinkage int
-my_sys_watch(const char * const dirname,
-				int option);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 19, 0)
+#define READ_ONCE(x)			ACCESS_ONCE(x)
+#endif
 
-asmlinkage int
-my_get_watch(const char * const file,
-				void *user_buf,
-				int buf_len);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 0, 0)
+#define WRITE_ONCE(x, val)		(ACCESS_ONCE(x) = (val))
+#endif
 
 /*
- * System calls related to file creation, time modification
+ * smp_load_acquire() and smp_store_release() came in 3.14
  */
-asmlinkage long
-my_sys_open(const char __user *filename,
-			int flags,
-			int mode);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)
+#define smp_load_acquire(p)					\
+	({ typeof(*(p)) ___v = ACCESS_ONCE(*(p)); smp_mb(); ___v; })
+#define smp_store_release(p, v)					\
+	do { smp_mb(); ACCESS_ONCE(*(p)) = (v); } while (0)
+#endif
 
-asmlinkage long
-my_sys_utimensat(int dfd,
-				const char __user *filename,
-				struct timespec __user *utimes,
-				int flags);
+/*
+ * Credentials of the current process and owner of an inode
+ * uids became kuid_t in 3.5
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 5, 0)
+#define kwatch_uid()			from_kuid(&init_user_ns, current_uid())
+#define kwatch_euid()			from_kuid(&init_user_ns, current_euid())
+#define kwatch_inode_uid(inode)	i_uid_read(inode)
+#else
+#define kwatch_uid()			current_uid()
+#define kwatch_euid()			current_euid()
+#define kwatch_inode_uid(inode)	((inode)->i_uid)
+#endif
 
-asmlinkage long
-my_sys_utimes(char __user *filename,
-			struct timeval __user *times);
+/*
+ * mmap_region() lost its flags argument in 3.9
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 9, 0)
+#define _MMAP_VM_FLAGS_ARG_		3
+#else
+#define _MMAP_VM_FLAGS_ARG_		4
+#endif
 
-asmlinkage long
-my_sys_chmod(const char __user *filename,
-			mode_t mode);
+/*
+ * Pages are dirtied as folios since 5.16
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+#define _DIRTY_SYMBOL_			"folio_mark_dirty"
+#else
+#define _DIRTY_SYMBOL_			"set_page_dirty"
+#endif
 
-asmlinkage long
-my_sys_mkdir(const char __user *pathname,
-			umode_t mode);
+/*
+ * What the entry handler of a VFS hook keeps for its return handler
+ * A write path keeps what rw_verify_area() found for it here: outer is
+ * the write path it runs inside of, req and kiocb are those of io_write()
+ */
+struct probe_data {
+	struct file *file;
+	struct dentry *dentry;
+	loff_t start;
+	loff_t len;
+	unsigned int ia_valid;
+	loff_t ia_size;
+	unsigned long type;
+	struct kwatch_key key;
+	struct kwatch_key watch;
+	u64 cost;
+	struct probe_data *outer;
+	void *req;
+	struct kiocb *kiocb;
+};
 
 /*
- * System calls related to date written to file
+ * Hook statistics, see stat_entry()
+ * _MAX_HOOKS_ bounds the number of probes, hist counts the calls
+ * which cost less than 2^i ns in bucket i
  */
-asmlinkage long
-my_sys_write(unsigned int fd,
-			const char __user *buf,
-			size_t count);
+#define _MAX_HOOKS_				24
+#define _HIST_BUCKETS_			32
+
+struct hook_stats {
+	unsigned long calls;
+	unsigned long filtered;
+	unsigned long staged;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long hist[_HIST_BUCKETS_];
+};
 
 /*
- * System calls related to file unlinking
+ * What notify_change() was called for
  */
-asmlinkage long
-my_sys_unlink(const char __user *pathname);
+#define _SETATTR_CHMOD_			0
+#define _SETATTR_CHOWN_			1
+#define _SETATTR_TRUNCATE_		2
+#define _SETATTR_UTIMES_		3
+#define _SETATTR_KINDS_			4
 
-asmlinkage long
-my_sys_rename(const char __user *oldname,
-				const char __user *newname);
+/*
+ * Statistics are off until switched on through debugfs, and cost a
+ * static branch until then. Kernels before 4.3 test a flag instead
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 3, 0)
+#define kwatch_stats_on()	static_branch_unlikely(&kwatch_stats_key)
+#define kwatch_stats_set(on)					\
+	((on) ? static_branch_enable(&kwatch_stats_key)		\
+		: static_branch_disable(&kwatch_stats_key))
+#else
+#define kwatch_stats_on()	unlikely(ACCESS_ONCE(kwatch_stats_flag))
+#define kwatch_stats_set(on)	(kwatch_stats_flag = (on))
+#endif
 
-asmlinkage long
-my_sys_rmdir(const char __user *pathname);
+/*
+ * Count an event against the hook running on this CPU
+ */
+#define hook_stat_inc(field)					\
+	do {							\
+		int ___hook;					\
+								\
+		if (kwatch_stats_on()) {			\
+			___hook = __this_cpu_read(cur_hook);	\
+			if (___hook >= 0)			\
+				this_cpu_inc(			\
+					hook_stats[___hook].field); \
+		}						\
+	} while (0)
 
 /*
- * System calls related to file truncation
+ * Data of a proc file, from its inode
  */
-asmlinkage long
-my_sys_truncate(const char __user *path,
-				long length);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
+#define kwatch_pde_data(inode)	pde_data(inode)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3, 10, 0)
+#define kwatch_pde_data(inode)	PDE_DATA(inode)
+#else
+#define kwatch_pde_data(inode)	(PDE(inode)->data)
+#endif
 
-asmlinkage long
-my_sys_ftruncate(unsigned int fd,
-					unsigned long length);
+/*
+ * Length of the name of the proc file of a watch, MAJOR:MINOR:INODE
+ */
+#define _PROC_NAME_LEN_			48
 
 /*
- * System calls related to file permissions and ownership
+ * The kretprobe of an instance, a field until 5.11
  */
-asmlinkage long
-my_sys_fchmod(unsigned int fd,
-				mode_t mode);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+#define kwatch_ri_probe(ri)		get_kretprobe(ri)
+#else
+#define kwatch_ri_probe(ri)		((ri)->rp)
+#endif
 
-asmlinkage long
-my_sys_fchown(unsigned int fd,
-				uid_t user,
-				gid_t group);
+/*
+ * Size of the ring of an open file of /dev/kwatch, see feed_open()
+ * In struct feed_hdr, tail sits on its own cache line, the reader
+ * being the only one writing it
+ */
+#define _FEED_HDR_SIZE_			PAGE_SIZE
+#define _FEED_SIZE_				(_FEED_HDR_SIZE_ + \
+					_FEED_RECS_ * sizeof(struct feed_rec))
 
-asmlinkage long
-my_sys_chmod(const char __user *filename,
-			mode_t mode);
+/*
+ * Reader of the feed, one per open file, chained in feeds
+ */
+struct feed {
+	struct list_head list;
+	struct kwatch_key watch;
+	int subscribed;
+	unsigned int threshold;
+	wait_queue_head_t wait;
+	struct feed_hdr *hdr;
+	struct feed_rec *rec;
+};
 
-asmlinkage long
-my_sys_chown(const char __user *filename,
-			uid_t user,
-			gid_t group);
+/*
+ * Return type of the poll of a file, its own type since 4.16
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+#define kwatch_poll_t			__poll_t
+#else
+#define kwatch_poll_t			unsigned int
+#endif
+
+/*
+ * Does a filesystem encode its handles the default way, as inode
+ * number and generation. Since 6.6 it says so with the default encoder
+ * instead of none
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 6, 0)
+#define kwatch_default_fh(op)	(!(op)->encode_fh || \
+					(op)->encode_fh == generic_encode_ino32_fh)
+#else
+#define kwatch_default_fh(op)	(!(op)->encode_fh)
+#endif
 
 /*
  * User defined functions
  */
-int is_stat(unsigned long inode);
-int get_inode(const char * const filename, unsigned long *inodeNo);
-int set_watch(const char * const dirname);
+void fill_key(struct inode *inode, struct kwatch_key *key);
+int key_equal(const struct kwatch_key *key1, const struct kwatch_key *key2);
+unsigned long hash_key(const struct kwatch_key *key, unsigned int bits);
+struct head_node *is_stat(const struct kwatch_key *key);
+int get_inode(const char * const filename, struct kwatch_key *key);
+int check_inode(struct inode *inode);
+int set_watch(const char * const dirname, unsigned int block_bits);
+int set_handle(const struct kwatch_key *key, unsigned int block_bits);
 int num_watch(void);
 int rem_watch(const char * const filename);
 int flush_watch(const char * const filename);
+int needs_rescan(const char * const filename);
+int snapshot_watch(const char * const filename);
+int add_consumer(const char * const filename);
+int rem_consumer(const char * const filename, unsigned int id);
+int ack_consumer(struct head_node *head, unsigned int id,
+			unsigned long long seq);
+void reclaim_acked(struct head_node *head);
+void unhash_data(struct head_node *head, struct data_node *node);
+struct data_node *first_since(struct head_node *head,
+			unsigned long long since);
+int query_size(unsigned int version);
+struct data_node *query_start(struct head_node *head,
+			struct user_query *query);
+void query_done(struct head_node *head, struct user_query *query,
+			struct data_node *node, struct data_node *last);
+int put_varint(unsigned char *p, unsigned long long v);
+int pack_record(struct data_node *node, unsigned char *buf,
+			struct path *root, unsigned int flags);
+struct inode *lookup_key(const struct kwatch_key *key,
+			struct super_block *sb);
+int put_handle(const struct kwatch_key *key, struct dentry *dentry,
+			struct super_block *sb, unsigned char *p);
+int put_path(struct dentry *dentry, struct path *root, unsigned char *p);
+int get_records(struct head_node *head, void *user_buf, int buf_len,
+			struct user_query *query, struct path *root);
+int match_query(struct data_node *node, struct user_query *query);
+struct head_node *detach_changes(struct head_node *head);
+void retire_changes(struct head_node *old);
+void free_changes(struct head_node *old);
+void reap_work_fn(struct work_struct *work);
 int num_changes(const char * const filename);
-void join_bits(int *obj1, int *obj2);
 char *my_get_from_user(const char * const dirname);
 /* void myprintf(char *frmt, ...); */
-unsigned long check_if_any_parent_is_watched(char *fileName);
-unsigned long check_if_any_parent_is_watched_filp(struct file *filePtr);
-void process_file_desc(unsigned int fd, int *bMap);
-void process_file_name(const char __user *filename, int *bMap);
-void add_data_to_obj(unsigned long head, unsigned long data, int *bMap);
+int check_if_any_parent_is_watched(char *fileName, struct kwatch_key *watch);
+int check_if_any_parent_is_watched_filp(struct file *filePtr,
+					struct kwatch_key *watch);
+int check_if_any_parent_is_watched_path(struct path *path,
+					struct kwatch_key *watch);
+int check_if_any_parent_is_watched_cached(struct dentry *dentry,
+					struct kwatch_key *watch);
+int check_if_any_parent_is_watched_dentry(struct dentry *dentry,
+					struct kwatch_key *watch);
+int lookup_verdict(struct dentry *dentry, unsigned int gen,
+			struct kwatch_key *watch);
+void store_verdict(struct dentry *dentry, unsigned int gen, int found,
+			const struct kwatch_key *watch);
+void bump_watch_gen(void);
+void stage_change(const struct kwatch_key *watch,
+			const struct kwatch_key *key, unsigned long bits,
+			loff_t start, loff_t len);
+int coalesce_stage(struct stage_rec *rec, const struct kwatch_key *watch,
+			const struct kwatch_key *key, unsigned long bits,
+			loff_t start, loff_t len);
+void rescan_watch(const struct kwatch_key *watch);
+void stage_overflow(const struct kwatch_key *watch);
+void drain_stages(void);
+void merge_stages(void);
+void merge_work_fn(struct work_struct *work);
+int file_filter(struct file *filePtr);
+int dentry_filter(struct dentry *dentry);
+int dentry_path_filter(struct dentry *dentry);
+int sb_has_watches(dev_t dev);
+void add_sb_watch(dev_t dev);
+void rem_sb_watch(dev_t dev);
+int add_mmap_watch(struct file *file, const struct kwatch_key *key,
+			const struct kwatch_key *watch);
+int find_mmap_watch(struct address_space *mapping, struct kwatch_key *key,
+			struct kwatch_key *watch);
+void sync_mmap_watches(const struct kwatch_key *watch, int mode);
+void mmap_prune_fn(struct work_struct *work);
+unsigned long probe_arg(struct pt_regs *regs, int n);
+void process_dentry(struct dentry *dentry, unsigned long bits,
+			loff_t start, loff_t len);
+struct write_slot *find_write_slot(void);
+int push_write(struct probe_data *data);
+void pop_write(struct probe_data *data);
+int add_async_write(struct kiocb *kiocb, struct file *file, loff_t start,
+			loff_t len);
+int take_async_write(struct kiocb *kiocb, struct async_write *ent);
+void expire_async_writes(void);
+void record_write(struct file *file, loff_t start, loff_t len, long written);
+int verify_entry(struct kretprobe_instance *ri, struct pt_regs *regs);
+int verify_ret(struct kretprobe_instance *ri, struct pt_regs *regs);
+int enter_write(struct probe_data *data, struct file *file);
+int write_entry(struct kretprobe_instance *ri, struct pt_regs *regs);
+int splice_entry(struct kretprobe_instance *ri, struct pt_regs *regs);
+int write_ret(struct kretprobe_instance *ri, struct pt_regs *regs);
+int io_write_entry(struct kretprobe_instance *ri, struct pt_regs *regs);
+int io_write_ret(struct kretprobe_instance *ri, struct pt_regs *regs);
+int io_complete_entry(struct kretprobe_instance *ri, struct pt_regs *regs);
+int write_path_probe(int hook);
+void check_missed(void);
+int fallocate_entry(struct kretprobe_instance *ri, struct pt_regs *regs);
+int fallocate_ret(struct kretprobe_instance *ri, struct pt_regs *regs);
+int setattr_entry(struct kretprobe_instance *ri, struct pt_regs *regs);
+int setattr_ret(struct kretprobe_instance *ri, struct pt_regs *regs);
+int delete_entry(struct kretprobe_instance *ri, struct pt_regs *regs);
+int delete_ret(struct kretprobe_instance *ri, struct pt_regs *regs);
+int create_entry(struct kretprobe_instance *ri, struct pt_regs *regs);
+int create_ret(struct kretprobe_instance *ri, struct pt_regs *regs);
+int mkdir_ret(struct kretprobe_instance *ri, struct pt_regs *regs);
+int open_entry(struct kretprobe_instance *ri, struct pt_regs *regs);
+int open_ret(struct kretprobe_instance *ri, struct pt_regs *regs);
+int rename_entry(struct kretprobe_instance *ri, struct pt_regs *regs);
+int rename_ret(struct kretprobe_instance *ri, struct pt_regs *regs);
+int mmap_entry(struct kretprobe_instance *ri, struct pt_regs *regs);
+int dirty_entry(struct kretprobe_instance *ri, struct pt_regs *regs);
+void stat_time(int hook, u64 ns);
+void stat_setattr(unsigned int ia_valid);
+int stat_entry(struct kretprobe_instance *ri, struct pt_regs *regs);
+int stat_ret(struct kretprobe_instance *ri, struct pt_regs *regs);
+int stats_show(struct seq_file *m, void *v);
+int stats_open(struct inode *inode, struct file *file);
+ssize_t stats_enable_read(struct file *file, char __user *buf,
+				size_t len, loff_t *ppos);
+ssize_t stats_enable_write(struct file *file, const char __user *buf,
+				size_t len, loff_t *ppos);
+void add_data_to_obj(struct head_node *head, const struct kwatch_key *key,
+			unsigned long bits, loff_t start, loff_t len);
+void add_extent(struct data_node *node, unsigned long first,
+			unsigned long last);
+int grow_extents(struct data_node *node);
+void merge_closest_extents(struct data_node *node);
+void fill_user_node(struct data_node *node, struct user_data_node *rec);
+void watch_proc_name(const struct kwatch_key *key, char *name);
+void add_watch_proc(struct head_node *head);
+void rem_watch_proc(struct head_node *head);
+int watch_proc_show(struct seq_file *m, void *v);
+int watch_proc_open(struct inode *inode, struct file *file);
+void feed_change(const struct stage_rec *rec);
+int feed_open(struct inode *inode, struct file *file);
+int feed_ring(struct feed *feed);
+int feed_release(struct inode *inode, struct file *file);
+int feed_mmap(struct file *file, struct vm_area_struct *vma);
+long feed_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+unsigned int feed_unread(struct feed *feed);
+kwatch_poll_t feed_poll(struct file *file, poll_table *wait);
+int get_extents(char *fileName, const struct kwatch_key *key,
+			void *user_buf, int buf_len, struct user_query *query);
+int get_changes(struct head_node *head, void *user_buf, int num,
+			struct user_query *query);
+int get_watch_list(void *user_buf, int num, struct user_query *query);
+struct data_node **alloc_hash(unsigned int bits);
+void free_hash(struct data_node **hash, unsigned int bits);
+struct data_node *find_data(struct head_node *head,
+			const struct kwatch_key *key);
+void hash_data(struct head_node *head, struct data_node *node);
+void unlink_data(struct head_node *head, struct data_node *node);
+void grow_hash(struct head_node *head);
+void reset_hash(struct head_node *head);
 void cleanup_obj(struct data_node *head);
 void cleanup_head(void);
@@ -0,0 +1,278 @@
+/*
+ * @file:			kWatchUser.h
+ *
+ * @Description:	Interface between kWatch and the programs using it:
+ *					the options of sysWatch(), the records
+ *					getWatch() copies out and the change feed
+ *					of /dev/kwatch. Included by the module as
+ *					well as by uWatch and the test programs
+ *
+ * @author:			Himanshu Jindal, Piyush Kansal
+ */
+
+#ifndef _KWATCH_USER_H_
+#define _KWATCH_USER_H_
+
+#ifndef __KERNEL__
+#include <stddef.h>
+#include <sys/ioctl.h>
+#endif
+
+/*
+ * Type of Watch
+ */
+#define _SET_WATCH_				0
+#define _REM_WATCH_				1
+#define _NUM_CHANGES_			2
+#define _NUM_WATCH_				3
+#define _FLUSH_WATCH_			4
+#define _NEEDS_RESCAN_			5
+#define _SNAPSHOT_WATCH_		6
+#define _ADD_CONSUMER_			7
+#define _REM_CONSUMER_			8
+
+/*
+ * The low byte of the option is the type of watch
+ * With _SET_WATCH_, the next byte may hold log2 of the chunk size of
+ * the new watch, 0 meaning the default Block_Size
+ * With _REM_CONSUMER_, it holds the consumer to remove
+ */
+#define _OPTION_MASK_			0xff
+#define _BLOCK_BITS_SHIFT_		8
+#define _BLOCK_BITS_MIN_		9
+#define _BLOCK_BITS_MAX_		30
+
+/*
+ * Change Type
+ */
+#define _FILE_MODIFY_BIT_		0
+#define _FILE_RENAME_BIT_		1
+#define _FILE_DELETE_BIT_		2
+#define _FILE_CREATE_BIT_		3
+#define _FILE_OWNER_BIT_		4
+#define _FILE_MODE_BIT_			5
+#define _FILE_TIME_BIT_			6
+#define _FILE_MMAP_BIT			7
+#define _CHANGE_MIN_			8
+#define _CHANGE_MAX_			126
+#define _FILE_REST_				127
+#define _CHANGE_OFFSET_			8
+
+/*
+ * Max changed ranges kept for a file
+ */
+#define _MAX_EXTENTS_			64
+
+/*
+ * Constant for getting watched directories list
+ */
+#define _DIR_LIST_				"@#"
+
+/*
+ * Record of a changed file copied to the user by my_get_watch()
+ * bMap holds the change type bits, then chunks 0 to 118 in bits 8 to
+ * 126, and _FILE_REST_ for any chunk beyond. next is always NULL
+ */
+struct user_data_node {
+	unsigned long inode;
+	int bMap[4];
+	void *next;
+};
+
+/*
+ * Changed byte range of a file copied to the user by my_get_watch()
+ * length is ~0 when the range runs up to the end of the file
+ */
+struct user_extent {
+	unsigned long long offset;
+	unsigned long long length;
+};
+
+/*
+ * Watched directory copied to the user by a paged my_get_watch() of
+ * _DIR_LIST_. An unpaged one copies its inode number alone, an
+ * unsigned long per watch
+ */
+struct user_watch {
+	unsigned long inode;
+	unsigned long block_size;
+};
+
+/*
+ * Header of a paged my_get_watch(), at the start of the user buffer,
+ * the records follow it. The call is only paged if _GET_PAGED_ is set
+ * in the length of the buffer passed, else the buffer only holds
+ * records and nothing is read from it
+ * On the first call flags is 0. Each call sets count, and sets
+ * _QUERY_MORE_ with the cursor to resume from if records are left:
+ * the next call passes the header back as it is. epoch changes when
+ * the watch is flushed, a cursor from before fails with -ESTALE
+ * _QUERY_SNAPSHOT_, set by the caller and kept across calls, reads the
+ * last snapshot of the watch instead of its live changes
+ * _QUERY_RESCAN_ comes back set if the changes read are not complete
+ * Since version 2, since asks only for the files changed after that
+ * sequence number, in the epoch passed. Once _QUERY_MORE_ is clear,
+ * seq is the sequence number everything was read up to: the since of
+ * the next read. A registered consumer passes its id, asking for the
+ * changes since N tells that it is done with those up to N
+ * Since version 3, only the files matching all of these are copied:
+ * mask, the change types wanted as 1 << _FILE_*_BIT_, min_chunks, the
+ * least number of chunks changed, a range up to the end of the file
+ * always matching, and type, S_IFMT bits of the mode. 0 matches all
+ * Since version 4, the records are packed, see struct kwatch_rec, and
+ * the header comes back with chunk_bits, log2 of the chunk size of the
+ * watch, and rec_fixed, the size of the part of a record before its
+ * chunk map. Reads of the watched directories and of byte ranges are
+ * the same in every version
+ * Also since version 4, _QUERY_HANDLE_ and _QUERY_PATH_, set by the
+ * caller and kept across calls, add to each record a handle of its file
+ * for open_by_handle_at() and its path relative to the watch
+ * Since version 5, cursor_ext is the cursor of a paged read of the byte
+ * ranges of a file. Older headers can only read those in one call
+ * Version 1 to 4 headers, without these, are still accepted
+ */
+#define _GET_PAGED_				0x40000000
+#define _QUERY_MAGIC_			0x6b57436bU
+#define _QUERY_VERSION_			5
+#define _QUERY_MORE_			0x1
+#define _QUERY_SNAPSHOT_		0x2
+#define _QUERY_RESCAN_			0x4
+#define _QUERY_HANDLE_			0x8
+#define _QUERY_PATH_			0x10
+
+struct user_query {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int size;
+	unsigned int count;
+	unsigned int flags;
+	unsigned int epoch;
+	unsigned long long cursor_ino;
+	unsigned int cursor_dev;
+	unsigned int cursor_gen;
+	unsigned long long since;
+	unsigned long long seq;
+	unsigned long long cursor_seq;
+	unsigned int consumer;
+	unsigned int pad;
+	unsigned int mask;
+	unsigned int min_chunks;
+	unsigned int type;
+	unsigned int pad2;
+	unsigned int chunk_bits;
+	unsigned int rec_fixed;
+	unsigned int cursor_ext;
+	unsigned int pad3;
+};
+
+#define _QUERY_V1_SIZE_			offsetof(struct user_query, since)
+#define _QUERY_V2_SIZE_			offsetof(struct user_query, mask)
+#define _QUERY_V3_SIZE_			offsetof(struct user_query, chunk_bits)
+#define _QUERY_V4_SIZE_			offsetof(struct user_query, cursor_ext)
+
+/*
+ * Packed record of a changed file, read by a version 4 query
+ * Records follow each other, each len bytes long and padded to 4
+ * bytes. bits holds the change types and the S_IFMT bits of the mode
+ * of the file, seq the sequence number of its last change
+ * Its chunk map starts rec_fixed bytes into the record, so that fields
+ * can be added before it without breaking older readers: the number of
+ * changed ranges, then for each the number of chunks between the end
+ * of the previous one and its start, and its number of chunks, 0 if it
+ * runs up to the end of the file. Each number is a varint: 7 bits per
+ * byte, the low ones first, the top bit set on every byte but the last
+ * With _QUERY_HANDLE_, the map is followed by the type of the handle of
+ * the file, the number of bytes of the handle and the bytes, which are
+ * what name_to_handle_at() gives as handle_type and f_handle. Then
+ * with _QUERY_PATH_, the length of the path of the file relative to the
+ * watch and the path, without a trailing NUL. Both lengths are varints
+ * and 0 for a file that could not be found, deleted or renamed out of
+ * the watch, or with a handle or path too long
+ * A buffer of _REC_MAX_ bytes holds any record
+ */
+struct kwatch_rec {
+	unsigned short len;
+	unsigned short bits;
+	unsigned int dev;
+	unsigned int gen;
+	unsigned long long ino;
+	unsigned long long seq;
+} __attribute__((packed));
+
+#define _VARINT_MAX_			10
+#define _HANDLE_MAX_			128
+#define _PATH_MAX_				4096
+#define _REC_MAX_				(sizeof(struct kwatch_rec) + \
+					(_MAX_EXTENTS_ * 2 + 4) * _VARINT_MAX_ + \
+					_HANDLE_MAX_ + _PATH_MAX_ + 3)
+
+/*
+ * Consumers registered on a watch, numbered from 1
+ * The records every one of them has read are freed
+ */
+#define _MAX_CONSUMERS_			8
+
+/*
+ * Change feed of /dev/kwatch
+ * The ring of an open file is one area the reader maps from its start:
+ * a header page, then num records of rec_size bytes. Mapping the header
+ * page alone tells how big the whole is. The kernel only writes head,
+ * the reader only tail, both only ever grow and rec is indexed by their
+ * low bits. dropped counts the changes left out of a full ring
+ */
+#define _FEED_MAGIC_			0x6b574664U
+#define _FEED_VERSION_			1
+#define _FEED_RECS_				16384
+
+/*
+ * WATCH subscribes the open file to the watch of the path passed
+ * THRESHOLD sets how many unread records make it readable, from 1,
+ * the default, to _FEED_RECS_
+ */
+#define _FEED_IOC_MAGIC_		'k'
+#define _FEED_IOC_WATCH_		_IOW(_FEED_IOC_MAGIC_, 1, char *)
+#define _FEED_IOC_THRESHOLD_	_IOW(_FEED_IOC_MAGIC_, 2, unsigned int)
+
+/*
+ * sysWatch() and getWatch() are ioctls of /dev/kwatch as well, a file
+ * opened for them alone gets no ring. option is the one of sysWatch(),
+ * buf_len the one of getWatch(), the ioctl returns what they return
+ */
+struct kwatch_call {
+	const char *file;
+	void *buf;
+	int option;
+	int buf_len;
+};
+
+#define _KWATCH_IOC_WATCH_		_IOW(_FEED_IOC_MAGIC_, 3, \
+					struct kwatch_call)
+#define _KWATCH_IOC_GET_		_IOW(_FEED_IOC_MAGIC_, 4, \
+					struct kwatch_call)
+
+struct feed_hdr {
+	unsigned int magic;
+	unsigned int version;
+	unsigned int num;
+	unsigned int rec_size;
+	unsigned int head;
+	unsigned int dropped;
+	unsigned int pad[10];
+	unsigned int tail;
+};
+
+/*
+ * A change as the merge saw it: length is ~0 when it runs up to the
+ * end of the file, both are 0 for changes without a range. bits holds
+ * the S_IFMT bits of the mode of the file too
+ */
+struct feed_rec {
+	unsigned long long ino;
+	unsigned int dev;
+	unsigned int gen;
+	unsigned long long bits;
+	unsigned long long offset;
+	unsigned long long length;
+};
+
+#endif
@@ -0,0 +1,507 @@
+/*
+ * @file:			libkwatch.c
+ *
+ * @Description:	Client library of kWatch, see libkwatch.h
+ *
+ * @author:			Himanshu Jindal, Piyush Kansal
+ */
+
+
+/*
+ * Include necessary header files
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include "libkwatch.h"
+
+
+/*
+ * Change feed, and the control calls
+ */
+#define _FEED_DEV_				"/dev/kwatch"
+
+/*
+ * File of /dev/kwatch the control calls go through, opened on first
+ * use and kept for the life of the process
+ */
+static int ctl_fd = -1;
+
+static int kwatch_call(unsigned long cmd, const char *file, void *buf,
+			int arg)
+{
+	struct kwatch_call call;
+	int fd = ctl_fd;
+
+	if (fd < 0) {
+		fd = open(_FEED_DEV_, O_RDWR | O_CLOEXEC);
+		if (fd < 0) {
+			return -1;
+		}
+
+		/* Another thread may have opened it first */
+		if (!__sync_bool_compare_and_swap(&ctl_fd, -1, fd)) {
+			close(fd);
+			fd = ctl_fd;
+		}
+	}
+
+	call.file = file;
+	call.buf = buf;
+	call.option = arg;
+	call.buf_len = arg;
+
+	return ioctl(fd, cmd, &call);
+}
+
+static int sys_watch(const char *dir, int option)
+{
+	return kwatch_call(_KWATCH_IOC_WATCH_, dir, NULL, option);
+}
+
+static int get_watch(const char *file, void *buf, int buf_len)
+{
+	return kwatch_call(_KWATCH_IOC_GET_, file, buf, buf_len);
+}
+
+
+int kwatch_chunk_bits(unsigned long chunk_size)
+{
+	int bits;
+
+	for (bits = _BLOCK_BITS_MIN_; bits <= _BLOCK_BITS_MAX_; bits++) {
+		if (chunk_size == 1UL << bits) {
+			return bits;
+		}
+	}
+
+	return -1;
+}
+
+int kwatch_set(const char *dir, unsigned long chunk_size)
+{
+	int bits = 0;
+
+	if (chunk_size) {
+		bits = kwatch_chunk_bits(chunk_size);
+		if (bits < 0) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	return sys_watch(dir, _SET_WATCH_ | (bits << _BLOCK_BITS_SHIFT_));
+}
+
+int kwatch_remove(const char *dir)
+{
+	return sys_watch(dir, _REM_WATCH_);
+}
+
+int kwatch_flush(const char *dir)
+{
+	return sys_watch(dir, _FLUSH_WATCH_);
+}
+
+int kwatch_snapshot(const char *dir)
+{
+	return sys_watch(dir, _SNAPSHOT_WATCH_);
+}
+
+int kwatch_num_changes(const char *dir)
+{
+	return sys_watch(dir, _NUM_CHANGES_);
+}
+
+int kwatch_needs_rescan(const char *dir)
+{
+	return sys_watch(dir, _NEEDS_RESCAN_);
+}
+
+int kwatch_num_watches(void)
+{
+	return sys_watch(NULL, _NUM_WATCH_);
+}
+
+int kwatch_add_consumer(const char *dir)
+{
+	return sys_watch(dir, _ADD_CONSUMER_);
+}
+
+int kwatch_remove_consumer(const char *dir, unsigned int id)
+{
+	return sys_watch(dir, _REM_CONSUMER_ | (id << _BLOCK_BITS_SHIFT_));
+}
+
+int kwatch_list_watches(struct user_watch *watch, int num)
+{
+	struct user_query *query;
+	size_t len;
+	int ret;
+
+	/* The chunk sizes only come with a paged read */
+	len = sizeof(struct user_query) + num * sizeof(struct user_watch);
+	query = malloc(len);
+	if (query == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	kwatch_query_init(query);
+	ret = kwatch_query(_DIR_LIST_, query, len);
+	if (ret > 0) {
+		memcpy(watch, query + 1, ret * sizeof(struct user_watch));
+	}
+
+	free(query);
+	return ret;
+}
+
+int kwatch_extents(const char *file, struct user_extent *ext, int num)
+{
+	return get_watch(file, ext, num * sizeof(struct user_extent));
+}
+
+void kwatch_query_init(struct user_query *query)
+{
+	memset(query, 0, sizeof(struct user_query));
+	query->magic = _QUERY_MAGIC_;
+	query->version = _QUERY_VERSION_;
+	query->size = sizeof(struct user_query);
+}
+
+int kwatch_query(const char *dir, void *buf, size_t len)
+{
+	/* The length tells the call is paged, it can not reach that bit */
+	if (len >= _GET_PAGED_) {
+		len = _GET_PAGED_ - 1;
+	}
+
+	return get_watch(dir, buf, (int) len | _GET_PAGED_);
+}
+
+int kwatch_varint(const unsigned char *p, const unsigned char *end,
+			unsigned long long *val)
+{
+	int i = 0, shift = 0;
+
+	*val = 0;
+	while (p + i < end && shift < 64) {
+		*val |= (unsigned long long) (p[i] & 0x7f) << shift;
+		shift += 7;
+		if (!(p[i++] & 0x80)) {
+			return i;
+		}
+	}
+
+	return 0;
+}
+
+int kwatch_decode(const struct kwatch_rec *rec, unsigned int fixed,
+			unsigned int flags, struct kwatch_change *change)
+{
+	const unsigned char *p = (const unsigned char *) rec + fixed;
+	const unsigned char *end = (const unsigned char *) rec + rec->len;
+	unsigned long long num, skip, count, chunk = 0;
+	unsigned long long val, len;
+	int n;
+
+	if (rec->len < sizeof(struct kwatch_rec) || fixed > rec->len) {
+		goto BAD;
+	}
+
+	memset(change, 0, offsetof(struct kwatch_change, range));
+	change->ino = rec->ino;
+	change->dev = rec->dev;
+	change->gen = rec->gen;
+	change->seq = rec->seq;
+	change->kinds = rec->bits & ((1 << _CHANGE_MIN_) - 1);
+	change->type = rec->bits & ~((1 << _CHANGE_MIN_) - 1);
+
+	n = kwatch_varint(p, end, &num);
+	if (!n || num > _MAX_EXTENTS_) {
+		goto BAD;
+	}
+
+	for (p += n; change->num_ranges < num; change->num_ranges++) {
+		n = kwatch_varint(p, end, &skip);
+		p += n;
+		if (n) {
+			n = kwatch_varint(p, end, &count);
+			p += n;
+		}
+		if (!n) {
+			goto BAD;
+		}
+
+		chunk += skip;
+		change->range[change->num_ranges].first = chunk;
+		change->range[change->num_ranges].count = count;
+		chunk += count;
+	}
+
+	change->handle_type = 0;
+	change->handle_bytes = 0;
+	change->handle = NULL;
+	change->path_len = 0;
+	change->path = NULL;
+
+	if (flags & _QUERY_HANDLE_) {
+		n = kwatch_varint(p, end, &val);
+		p += n;
+		if (n) {
+			n = kwatch_varint(p, end, &len);
+			p += n;
+		}
+		if (!n || len > (unsigned long long) (end - p)) {
+			goto BAD;
+		}
+
+		change->handle_type = val;
+		change->handle_bytes = len;
+		change->handle = p;
+		p += len;
+	}
+
+	if (flags & _QUERY_PATH_) {
+		n = kwatch_varint(p, end, &len);
+		p += n;
+		if (!n || len > (unsigned long long) (end - p)) {
+			goto BAD;
+		}
+
+		change->path_len = len;
+		change->path = (const char *) p;
+	}
+
+	return 0;
+
+BAD:
+	errno = EPROTO;
+	return -1;
+}
+
+int kwatch_iter_init(struct kwatch_iter *iter, const char *dir,
+			const struct user_query *init, void *buf, size_t len)
+{
+	if (NULL == buf) {
+		len = _KWATCH_BUF_SIZE_;
+		buf = malloc(len);
+		if (NULL == buf) {
+			return -1;
+		}
+		iter->own_buf = 1;
+	} else if (len < sizeof(struct user_query) + _REC_MAX_) {
+		errno = EINVAL;
+		return -1;
+	} else {
+		iter->own_buf = 0;
+	}
+
+	iter->dir = dir;
+	iter->buf = buf;
+	iter->len = len;
+	iter->query = (struct user_query *) buf;
+
+	memset(iter->query, 0, sizeof(struct user_query));
+	kwatch_iter_rewind(iter, init ? init : iter->query);
+
+	return 0;
+}
+
+void kwatch_iter_rewind(struct kwatch_iter *iter,
+			const struct user_query *init)
+{
+	struct user_query *query = iter->query;
+
+	if (init) {
+		*query = *init;
+	} else {
+		/* Carry on from where the last read ended */
+		query->since = query->seq;
+		query->flags &= ~(_QUERY_MORE_ | _QUERY_RESCAN_);
+	}
+
+	query->magic = _QUERY_MAGIC_;
+	query->version = _QUERY_VERSION_;
+	query->size = sizeof(struct user_query);
+
+	iter->next = NULL;
+	iter->left = 0;
+}
+
+int kwatch_iter_next(struct kwatch_iter *iter, struct kwatch_change *change)
+{
+	struct kwatch_rec *rec;
+	int ret;
+
+	/* A page may hold no record, all of its files filtered out */
+	while (0 == iter->left) {
+		if (iter->next && !(iter->query->flags & _QUERY_MORE_)) {
+			return 0;
+		}
+
+		ret = kwatch_query(iter->dir, iter->buf, iter->len);
+		if (ret < 0) {
+			return -1;
+		}
+
+		iter->next = (char *) (iter->query + 1);
+		iter->left = ret;
+	}
+
+	rec = (struct kwatch_rec *) iter->next;
+	if (kwatch_decode(rec, iter->query->rec_fixed, iter->query->flags,
+				change) < 0) {
+		return -1;
+	}
+
+	iter->next += rec->len;
+	iter->left--;
+
+	return 1;
+}
+
+void kwatch_iter_end(struct kwatch_iter *iter)
+{
+	if (iter->own_buf && iter->buf) {
+		free(iter->buf);
+	}
+
+	iter->buf = NULL;
+	iter->query = NULL;
+}
+
+int kwatch_feed_open(struct kwatch_feed *feed, const char *dir,
+			unsigned int threshold)
+{
+	struct feed_hdr *hdr = MAP_FAILED;
+	int fd, err;
+
+	memset(feed, 0, sizeof(struct kwatch_feed));
+	feed->fd = -1;
+
+	fd = open(_FEED_DEV_, O_RDWR);
+	if (fd < 0) {
+		goto OUT;
+	}
+
+	if (ioctl(fd, _FEED_IOC_WATCH_, dir) < 0) {
+		goto OUT;
+	}
+
+	if (ioctl(fd, _FEED_IOC_THRESHOLD_, &threshold) < 0) {
+		goto OUT;
+	}
+
+	/* The header page tells how big the ring is */
+	hdr = mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED, fd, 0);
+	if (MAP_FAILED == hdr) {
+		goto OUT;
+	}
+
+	feed->size = getpagesize() + (size_t)hdr->num * hdr->rec_size;
+	if (hdr->magic != _FEED_MAGIC_ || hdr->version != _FEED_VERSION_
+			|| hdr->rec_size != sizeof(struct feed_rec)
+			|| 0 == hdr->num || (hdr->num & (hdr->num - 1))) {
+		munmap(hdr, getpagesize());
+		errno = EPROTO;
+		goto OUT;
+	}
+
+	munmap(hdr, getpagesize());
+	hdr = mmap(NULL, feed->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			fd, 0);
+	if (MAP_FAILED == hdr) {
+		goto OUT;
+	}
+
+	feed->fd = fd;
+	feed->hdr = hdr;
+	feed->rec = (struct feed_rec *) ((char *) hdr + getpagesize());
+	feed->threshold = threshold;
+	feed->tail = hdr->tail;
+	feed->head = feed->tail;
+	feed->dropped = hdr->dropped;
+
+	return 0;
+
+OUT:
+	if (fd >= 0) {
+		err = errno;
+		close(fd);
+		errno = err;
+	}
+
+	return -1;
+}
+
+int kwatch_feed_wait(struct kwatch_feed *feed, int timeout)
+{
+	struct pollfd pfd;
+	int ret;
+
+	/* What was returned so far is done with */
+	__atomic_store_n(&feed->hdr->tail, feed->tail, __ATOMIC_RELEASE);
+
+	pfd.fd = feed->fd;
+	pfd.events = POLLIN;
+
+	while (1) {
+		feed->head = __atomic_load_n(&feed->hdr->head,
+						__ATOMIC_ACQUIRE);
+		if (feed->head - feed->tail >= feed->threshold) {
+			break;
+		}
+
+		ret = poll(&pfd, 1, timeout);
+		if (ret < 0 && errno != EINTR) {
+			return -1;
+		}
+
+		if (0 == ret) {
+			feed->head = __atomic_load_n(&feed->hdr->head,
+							__ATOMIC_ACQUIRE);
+			break;
+		}
+	}
+
+	return feed->head - feed->tail;
+}
+
+const struct feed_rec *kwatch_feed_next(struct kwatch_feed *feed)
+{
+	if (feed->tail == feed->head) {
+		return NULL;
+	}
+
+	return &feed->rec[feed->tail++ & (feed->hdr->num - 1)];
+}
+
+unsigned int kwatch_feed_dropped(struct kwatch_feed *feed)
+{
+	unsigned int dropped = feed->hdr->dropped;
+	unsigned int ret = dropped - feed->dropped;
+
+	feed->dropped = dropped;
+
+	return ret;
+}
+
+void kwatch_feed_close(struct kwatch_feed *feed)
+{
+	if (feed->hdr) {
+		munmap(feed->hdr, feed->size);
+		feed->hdr = NULL;
+	}
+
+	if (feed->fd >= 0) {
+		close(feed->fd);
+		feed->fd = -1;
+	}
+}
@@ -0,0 +1,159 @@
+/*
+ * @file:			libkwatch.h
+ *
+ * @Description:	Client library of kWatch. Wraps sysWatch() and
+ *					getWatch(), so that programs need
+ *					neither their ioctls nor the layout of
+ *					the records:
+ *					1. watch management
+ *					2. reading the changes of a watch one file at
+ *						a time, a page of records per call
+ *					3. waiting for changes on /dev/kwatch
+ *					Functions returning int return -1 and set errno
+ *					on error, as ioctl() does
+ *
+ * @author:			Himanshu Jindal, Piyush Kansal
+ */
+
+#ifndef _LIBKWATCH_H_
+#define _LIBKWATCH_H_
+
+#include "kWatchUser.h"
+
+/*
+ * Default size of the buffer of an iterator, see kwatch_iter_init()
+ */
+#define _KWATCH_BUF_SIZE_		(64 * 1024)
+
+/*
+ * Watch management
+ * chunk_size of kwatch_set() is a power of 2 from 512 to 1G, 0 for the
+ * default. kwatch_chunk_bits() gives its log2, -1 if it is not valid
+ */
+int kwatch_chunk_bits(unsigned long chunk_size);
+int kwatch_set(const char *dir, unsigned long chunk_size);
+int kwatch_remove(const char *dir);
+int kwatch_flush(const char *dir);
+int kwatch_snapshot(const char *dir);
+int kwatch_num_changes(const char *dir);
+int kwatch_needs_rescan(const char *dir);
+int kwatch_num_watches(void);
+int kwatch_add_consumer(const char *dir);
+int kwatch_remove_consumer(const char *dir, unsigned int id);
+int kwatch_list_watches(struct user_watch *watch, int num);
+int kwatch_extents(const char *file, struct user_extent *ext, int num);
+
+/*
+ * One paged call of getWatch() for a page of records. buf starts with
+ * a struct user_query, which the caller fills, see kwatch_query_init()
+ * Returns the number of records after the header
+ */
+void kwatch_query_init(struct user_query *query);
+int kwatch_query(const char *dir, void *buf, size_t len);
+
+/*
+ * Changed range of a file, in chunks. count is 0 when it runs up to
+ * the end of the file
+ */
+struct kwatch_range {
+	unsigned long long first;
+	unsigned long long count;
+};
+
+/*
+ * A changed file, as kwatch_iter_next() decodes it. kinds holds the
+ * change types, 1 << _FILE_*_BIT_, type the S_IFMT bits of its mode
+ * handle and path point into the buffer of the iterator, until the
+ * next call. path is not NUL terminated. Both are only there if the
+ * query asked for them, and empty if the file could not be found
+ */
+struct kwatch_change {
+	unsigned long long ino;
+	unsigned int dev;
+	unsigned int gen;
+	unsigned long long seq;
+	unsigned int kinds;
+	unsigned int type;
+	unsigned int num_ranges;
+	struct kwatch_range range[_MAX_EXTENTS_];
+	unsigned int handle_type;
+	unsigned int handle_bytes;
+	const unsigned char *handle;
+	unsigned int path_len;
+	const char *path;
+};
+
+/*
+ * Decode a packed record of a page read by kwatch_query(), fixed and
+ * flags being those of its header, see struct kwatch_rec
+ * kwatch_varint() decodes one varint, returns the bytes read, 0 if it
+ * runs past end
+ */
+int kwatch_varint(const unsigned char *p, const unsigned char *end,
+			unsigned long long *val);
+int kwatch_decode(const struct kwatch_rec *rec, unsigned int fixed,
+			unsigned int flags, struct kwatch_change *change);
+
+/*
+ * Reads the changes of a watch one file at a time, a page per call of
+ * getWatch(), into a buffer allocated once by kwatch_iter_init(), or
+ * given by the caller, and reused for every page and every read
+ * query is at the start of the buffer: once kwatch_iter_next() returns
+ * 0, its epoch and seq tell where the read ended, and _QUERY_RESCAN_ in
+ * its flags if changes were lost
+ */
+struct kwatch_iter {
+	const char *dir;
+	char *buf;
+	size_t len;
+	int own_buf;
+	struct user_query *query;
+	char *next;
+	unsigned int left;
+};
+
+/*
+ * init gives what to read, see struct user_query: flags, position,
+ * consumer and filter. NULL reads every change. With a NULL buf, one
+ * of _KWATCH_BUF_SIZE_ bytes is allocated, else it has to hold the
+ * header and _REC_MAX_ bytes of records
+ * kwatch_iter_next() returns 1 with the next file in change, 0 when
+ * there are no more. kwatch_iter_rewind() starts a new read with the
+ * same buffer: of init, or with NULL of the changes since the end of
+ * the last one, with the same flags and filter
+ */
+int kwatch_iter_init(struct kwatch_iter *iter, const char *dir,
+			const struct user_query *init, void *buf, size_t len);
+int kwatch_iter_next(struct kwatch_iter *iter, struct kwatch_change *change);
+void kwatch_iter_rewind(struct kwatch_iter *iter,
+			const struct user_query *init);
+void kwatch_iter_end(struct kwatch_iter *iter);
+
+/*
+ * Change feed of a watch, see struct feed_hdr
+ * kwatch_feed_wait() sleeps until threshold changes are waiting, or
+ * timeout ms, -1 for ever, and returns how many are. kwatch_feed_next()
+ * returns them one at a time, NULL once there are no more: they stay
+ * in the ring, valid until the next kwatch_feed_wait().
+ * kwatch_feed_dropped() returns how many changes were left out of the
+ * ring since it was last called
+ */
+struct kwatch_feed {
+	int fd;
+	struct feed_hdr *hdr;
+	struct feed_rec *rec;
+	size_t size;
+	unsigned int threshold;
+	unsigned int head;
+	unsigned int tail;
+	unsigned int dropped;
+};
+
+int kwatch_feed_open(struct kwatch_feed *feed, const char *dir,
+			unsigned int threshold);
+int kwatch_feed_wait(struct kwatch_feed *feed, int timeout);
+const struct feed_rec *kwatch_feed_next(struct kwatch_feed *feed);
+unsigned int kwatch_feed_dropped(struct kwatch_feed *feed);
+void kwatch_feed_close(struct kwatch_feed *feed);
+
+#endif
@@ -0,0 +1,190 @@
+/*
+ * @file:			feedTest.c
+ *
+ * @Description:	Follows a watch through the ring of /dev/kwatch
+ *			with the feed calls of libkwatch, and checks that
+ *			the changes it makes itself are read off it: one
+ *			chmod of each of the given files, which have to be
+ *			under the watch. With a threshold, checks that the
+ *			feed stays quiet until that many are waiting
+ *
+ * @author:		Himanshu Jindal, Piyush Kansal
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../libkwatch.h"
+
+/*
+ * How long to wait for the changes, in ms
+ */
+#define _WAIT_MS_		5000
+
+/*
+ * How long the feed has to stay quiet below its threshold, in ms
+ */
+#define _QUIET_MS_		1000
+
+
+/*
+ * Function to denote the usage of this program
+ */
+void usage(char *prg)
+{
+	printf("Usage: %s -d DIR [-t THRESHOLD] FILE...", prg);
+	printf("\n\t-d ARG: directory under watch"
+			"\n\t-t ARG: wake up once ARG changes are waiting,"
+			" with at least ARG files\n"
+			"\tFILE: files under it to change, up to 64 of them\n");
+}
+
+/*
+ * Change each file once, and read the changes off the ring until all
+ * of them were seen
+ */
+int follow_files(struct kwatch_feed *feed, char **files, int num)
+{
+	const struct feed_rec *rec;
+	unsigned long long ino[64];
+	int seen[64] = { 0 };
+	int left = num;
+	struct stat st;
+	int i;
+
+	for (i = 0; i < num; i++) {
+		if (stat(files[i], &st) < 0 || chmod(files[i], 0600) < 0) {
+			perror(files[i]);
+			return -1;
+		}
+
+		ino[i] = st.st_ino;
+	}
+
+	while (left && kwatch_feed_wait(feed, _WAIT_MS_) > 0) {
+		while ((rec = kwatch_feed_next(feed)) != NULL) {
+			for (i = 0; i < num; i++) {
+				if (!seen[i] && rec->ino == ino[i]) {
+					seen[i] = 1;
+					left--;
+				}
+			}
+		}
+	}
+
+	for (i = 0; i < num; i++) {
+		printf("Read the change of %s off the ring: %s\n", files[i],
+			seen[i] ? "SUCCESSFULLY" : "FAILED");
+	}
+
+	return left ? -1 : 0;
+}
+
+long long elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000LL +
+		(now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/*
+ * Change threshold - 1 files, which must not wake the feed up, then
+ * one more, which must
+ */
+int check_threshold(struct kwatch_feed *feed, char **files,
+			unsigned int threshold)
+{
+	struct timespec start;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i + 1 < threshold; i++) {
+		if (chmod(files[i], 0600) < 0) {
+			perror(files[i]);
+			return -1;
+		}
+	}
+
+	ret = kwatch_feed_wait(feed, _QUIET_MS_);
+	if (ret < 0 || (unsigned int)ret >= threshold) {
+		printf("%u changes, waiting for %u, stayed quiet: FAILED\n",
+			threshold - 1, threshold);
+		return -1;
+	}
+
+	printf("%u changes, waiting for %u, stayed quiet: SUCCESSFULLY\n",
+		threshold - 1, threshold);
+
+	if (chmod(files[threshold - 1], 0600) < 0) {
+		perror(files[threshold - 1]);
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ret = kwatch_feed_wait(feed, _WAIT_MS_);
+	if (ret < 0 || (unsigned int)ret < threshold ||
+		elapsed_ms(&start) >= _WAIT_MS_) {
+		printf("%u changes, woken up: FAILED\n", threshold);
+		return -1;
+	}
+
+	printf("%u changes, woken up: SUCCESSFULLY\n", threshold);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct kwatch_feed feed;
+	char *dir = NULL;
+	unsigned int threshold = 0;
+	int ret;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:t:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			dir = optarg;
+			break;
+
+		case 't':
+			threshold = strtoul(optarg, NULL, 0);
+			break;
+
+		case 'h':
+		default:
+			usage(argv[0]);
+			exit(0);
+		}
+	}
+
+	if (NULL == dir || optind == argc || argc - optind > 64 ||
+		threshold > (unsigned int)(argc - optind)) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	if (kwatch_feed_open(&feed, dir, threshold ? threshold : 1) < 0) {
+		perror("kwatch_feed_open");
+		return -1;
+	}
+
+	printf("Opened the feed of %s: SUCCESSFULLY\n", dir);
+
+	if (threshold) {
+		ret = check_threshold(&feed, argv + optind, threshold);
+	} else {
+		ret = follow_files(&feed, argv + optind, argc - optind);
+	}
+
+	kwatch_feed_close(&feed);
+
+	return ret;
+}
@@ -8,46 +8,13 @@
 #include <fcntl.h>
 
 
-#define _SET_WATCH_				0
-#define _REM_WATCH_				1
-#define _NUM_CHANGES_			2
-#define _NUM_WATCH_				3
-#define _FLUSH_WATCH_			4
-
-/*
- * File Type
- */
-#define _MY_MODE_				0
-
-/*
- * Change Type
- */
-#define _FILE_MODIFY_BIT_		0
-#define _FILE_RENAME_BIT_		1
-#define _FILE_DELETE_BIT_		2
-#define _FILE_CREATE_BIT_		3
-#define _FILE_OWNER_BIT_		4
-#define _FILE_MODE_BIT_			5
-#define _FILE_TIME_BIT_			6
-#define _FILE_MMAP_BIT			7
-#define _CHANGE_MIN_			8
-#define _CHANGE_MAX_			126
-#define _FILE_REST_				127
-#define _CHANGE_OFFSET_			8
+#include "../libkwatch.h"
 
 #define CHECK_BIT(var,pos) (*(var+pos) & 1)
 
-struct data_node {
-	unsigned long inode;
-	int bMap[4];
-	struct data_node* next;
-};
-
 /*
  * Function to denote the usage of this program
  */
-#define NODE_SIZE sizeof(struct data_node)
-
 void usage( char *prg ) {
 	printf( "Usage: %s [Option]\n", prg );
 	printf( "\n\t-n ARG: get number of inodes under a  watch point. ARG denotes the watch-point			\
@@ -100,10 +67,6 @@ int do_file_func(char *path, int n) {
 	return ret;
 }
 
-int check_bit(int *bMap, int position) {
-	 return bMap[position/32] & (1 << (position%32));
-}
-
 int main( int argc, char **argv )
 {
 	int length;
@@ -113,9 +76,8 @@ int main( int argc, char **argv )
 	int ret = 0;
 	int i = 0;
 	int num_node;
-	void *temp_data = NULL;
-	struct data_node *temp_node = NULL;
-	unsigned long inode_num;
+	struct kwatch_iter iter;
+	struct kwatch_change change;
 	int num1;
 	int j = 0;
 	void* bit;
@@ -156,7 +118,7 @@ int main( int argc, char **argv )
 	 * get the buffer
 	 * display it
 	 */
-	ret = syscall( 349, "kwatch_test/dir1", _SET_WATCH_ );
+	ret = kwatch_set( "kwatch_test/dir1", 0 );
 	if(ret < 0) {
 		perror("error_kwatch\n");
 		return -1;
@@ -167,74 +129,73 @@ int main( int argc, char **argv )
 		perror( "do_file_func");
 	}
 
-	num_node = syscall( 349, "kwatch_test/dir1", _NUM_CHANGES_ );
+	num_node = kwatch_num_changes( "kwatch_test/dir1" );
+	printf("\n%d files changed", num_node);
 
-	temp_data = malloc(NODE_SIZE*num_node);
-	if(temp_data == NULL) {
+	ret = kwatch_iter_init( &iter, "kwatch_test/dir1", NULL, NULL, 0 );
+	if(ret < 0) {
 		perror("memory exhausted");
 		return -1;
 	}
 
-	ret = syscall( 350, "kwatch_test/dir1", temp_data, NODE_SIZE*num_node );
-	if(ret < 0) {
-		perror("error retreiving buf");
-	}
+	while( (ret = kwatch_iter_next( &iter, &change )) > 0 ) {
+		printf("\n%llu\t", change.ino);
 
-	for( i = 0; i < ret; i++ ) {
-		temp_node = ((struct data_node *)temp_data) + i;
-		inode_num = temp_node->inode;
-		if(inode_num != 0){
-			printf("\n%lu\t%u\t%u\t%u\t%u", inode_num, temp_node->bMap[0], temp_node->bMap[1], temp_node->bMap[2], temp_node->bMap[3]);
-			
-			for( j = 0; j < sizeof(int)*4*8; j++ ) {
-				if(check_bit(temp_node->bMap, j)) {
-					switch(j) {
-					case _FILE_MODIFY_BIT_:
-						printf(" Modified ");
-						break;
-
-					case _FILE_RENAME_BIT_:
-						printf(" Renamed ");
-						break;
-
-					case _FILE_DELETE_BIT_:
-						printf(" Deleted ");
-						break;
-
-					case _FILE_CREATE_BIT_:
-						printf(" Created ");
-						break;
-
-					case _FILE_OWNER_BIT_:
-						printf(" Owner_Changed ");
-						break;
-
-					case _FILE_MODE_BIT_:
-						printf(" Mode_Changed ");
-						break;
-
-					case _FILE_TIME_BIT_:
-						printf(" AccessTime_Changed ");
-						break;
-
-					case _FILE_MMAP_BIT:
-						printf(" Change_via_Mmap ");
-						break;
-
-					case _FILE_REST_:
-						printf(" >119_block_changed ");
-						break;
-
-					default:
-						printf("%d:", j-8);
-						break;
-					}
+		for( j = 0; j < _CHANGE_MIN_; j++ ) {
+			if(change.kinds & (1 << j)) {
+				switch(j) {
+				case _FILE_MODIFY_BIT_:
+					printf(" Modified ");
+					break;
+
+				case _FILE_RENAME_BIT_:
+					printf(" Renamed ");
+					break;
+
+				case _FILE_DELETE_BIT_:
+					printf(" Deleted ");
+					break;
+
+				case _FILE_CREATE_BIT_:
+					printf(" Created ");
+					break;
+
+				case _FILE_OWNER_BIT_:
+					printf(" Owner_Changed ");
+					break;
+
+				case _FILE_MODE_BIT_:
+					printf(" Mode_Changed ");
+					break;
+
+				case _FILE_TIME_BIT_:
+					printf(" AccessTime_Changed ");
+					break;
+
+				case _FILE_MMAP_BIT:
+					printf(" Change_via_Mmap ");
+					break;
 				}
 			}
 		}
+
+		for( i = 0; i < change.num_ranges; i++ ) {
+			if(change.range[i].count == 0)
+				printf("%llu-:", change.range[i].first);
+			else
+				printf("%llu-%llu:", change.range[i].first,
+					change.range[i].first + change.range[i].count - 1);
+		}
 	}
 
-	ret = syscall( 349, "kwatch_test/dir1", _REM_WATCH_ );
+	if(ret < 0) {
+		perror("error retreiving buf");
+	}
+
+	kwatch_iter_end( &iter );
+	printf("\n");
+
+	ret = kwatch_remove( "kwatch_test/dir1" );
 
 	return 1;
 }
@@ -0,0 +1,105 @@
+/*
+ * @file:			mmapWrite.c
+ *
+ * @Description:	Writes to a file through a shared mapping only,
+ *			the way mmap based stores do, never calling write().
+ *			Sets one byte at each of the given offsets, then
+ *			syncs the mapping
+ *
+ * @author:		Himanshu Jindal, Piyush Kansal
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+
+/*
+ * Function to denote the usage of this program
+ */
+void usage(char *prg)
+{
+	printf("Usage: %s -f FILE -o OFFSET [-o OFFSET...]", prg);
+	printf("\n\t-f ARG: existing file to write to, it is not grown"
+			"\n\t-o ARG: byte offset to change, up to 64 of them\n");
+}
+
+int main(int argc, char **argv)
+{
+	char *file = NULL;
+	char *map = NULL;
+	long long offsets[64];
+	int num = 0;
+	struct stat st;
+	int fd;
+	int opt;
+	int i;
+
+	while ((opt = getopt(argc, argv, "f:o:h")) != -1) {
+		switch (opt) {
+		case 'f':
+			file = optarg;
+			break;
+
+		case 'o':
+			if (num < 64) {
+				offsets[num++] = atoll(optarg);
+			}
+			break;
+
+		case 'h':
+		default:
+			usage(argv[0]);
+			exit(0);
+		}
+	}
+
+	if (NULL == file || 0 == num) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	fd = open(file, O_RDWR);
+	if (fd < 0) {
+		perror("open");
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0 || 0 == st.st_size) {
+		printf("%s is empty\n", file);
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			fd, 0);
+	if (MAP_FAILED == map) {
+		perror("mmap");
+		close(fd);
+		return -1;
+	}
+
+	for (i = 0; i < num; i++) {
+		if (offsets[i] < 0 || offsets[i] >= st.st_size) {
+			printf("offset %lld is outside of %s\n",
+				offsets[i], file);
+			continue;
+		}
+
+		map[offsets[i]] = 'k';
+		printf("wrote offset %lld\n", offsets[i]);
+	}
+
+	if (msync(map, st.st_size, MS_SYNC) < 0) {
+		perror("msync");
+	}
+
+	munmap(map, st.st_size);
+	close(fd);
+
+	return 0;
+}
@@ -0,0 +1,20 @@
+#Test for tracking changes made through a shared mapping
+#cleanup pre existing folders
+rm -Rf dir1
+mkdir dir1
+rmmod kWatch
+dd if=/dev/zero of=dir1/file bs=1M count=4 2>/dev/null
+insmod ../kWatch.ko
+.././uWatch -s dir1
+echo "Created a 4MB file, and set watch on its directory: SUCCESSFULLY"
+./mmapWrite -f dir1/file -o 0 -o 1048576 -o 3145728
+echo "Wrote 3 pages through mmap"
+.././uWatch -g dir1
+.././uWatch -e dir1/file
+#pages written again after a flush are seen again
+.././uWatch -f dir1
+./mmapWrite -f dir1/file -o 2097152
+echo "Flushed, then wrote 1 more page through mmap"
+.././uWatch -e dir1/file
+rmmod kWatch.ko
+rm -Rf dir1
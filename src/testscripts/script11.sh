@@ -0,0 +1,20 @@
+#Test for reading a large change set a page at a time
+#Usage: ./script11.sh [num-of-files]
+NUM=${1:-5000}
+#cleanup pre existing folders
+rm -Rf dir1
+mkdir dir1
+rmmod kWatch
+insmod ../kWatch.ko
+.././uWatch -s dir1
+echo "Created a directory and set watch on it: SUCCESSFULLY"
+for i in $(seq 1 $NUM); do
+	echo $i > dir1/file$i
+done
+echo "Created $NUM files"
+.././uWatch -n dir1
+#one line per file, whatever the number of pages read
+echo "Files listed by uWatch -g:"
+.././uWatch -g dir1 | grep -c "Created"
+rmmod kWatch.ko
+rm -Rf dir1
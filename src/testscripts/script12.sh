@@ -0,0 +1,38 @@
+#Test for following the changes of a watch through /dev/kwatch
+#cleanup pre existing folders
+rm -Rf dir1
+mkdir dir1
+rmmod kWatch
+insmod ../kWatch.ko
+.././uWatch -s dir1
+echo "Set watch on dir1: SUCCESSFULLY"
+.././uWatch -w dir1 > follow.log &
+FOLLOW=$!
+sleep 1
+touch dir1/a dir1/b
+echo "hello" >> dir1/a
+chmod 600 dir1/b
+rm dir1/b
+sleep 1
+kill $FOLLOW
+wait $FOLLOW 2>/dev/null
+echo "Changes followed through /dev/kwatch:"
+cat follow.log
+#the feed does not consume them, the watch still has them
+.././uWatch -g dir1
+#with a threshold, nothing is printed until 3 changes are waiting
+.././uWatch -w dir1 -t 3 > follow.log &
+FOLLOW=$!
+sleep 1
+touch dir1/c dir1/d
+sleep 1
+echo "2 changes, waiting for 3: `wc -l < follow.log` lines printed"
+touch dir1/e
+sleep 1
+kill $FOLLOW
+wait $FOLLOW 2>/dev/null
+echo "3 changes, woken up:"
+cat follow.log
+rm -f follow.log
+rmmod kWatch.ko
+rm -Rf dir1
@@ -0,0 +1,29 @@
+#Test for reading and resetting a watch in one go
+#cleanup pre existing folders
+rm -Rf dir1
+mkdir dir1
+rmmod kWatch
+insmod ../kWatch.ko
+.././uWatch -s dir1
+echo "Set watch on dir1: SUCCESSFULLY"
+touch dir1/a dir1/b dir1/c
+echo "Created 3 files"
+.././uWatch -x dir1
+#the watch was reset by the snapshot
+.././uWatch -n dir1
+touch dir1/d
+echo "Created 1 more file, only it is listed now"
+.././uWatch -x dir1
+#changes made while snapshots are taken are never lost
+for i in `seq 1 2000`; do touch dir1/f$i; done &
+WRITER=$!
+TOTAL=0
+while kill -0 $WRITER 2>/dev/null; do
+	N=`.././uWatch -x dir1 | grep -c "Created"`
+	TOTAL=$((TOTAL + N))
+done
+N=`.././uWatch -x dir1 | grep -c "Created"`
+TOTAL=$((TOTAL + N))
+echo "Created 2000 files while taking snapshots, $TOTAL listed"
+rmmod kWatch.ko
+rm -Rf dir1
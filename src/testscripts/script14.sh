@@ -0,0 +1,27 @@
+#Test for incremental reads by several consumers of one watch
+#cleanup pre existing folders
+rm -Rf dir1
+mkdir dir1
+rmmod kWatch
+insmod ../kWatch.ko
+.././uWatch -s dir1
+.././uWatch -a dir1
+.././uWatch -a dir1
+echo "Set watch on dir1, registered consumers 1 and 2: SUCCESSFULLY"
+touch dir1/a dir1/b
+POS1=`.././uWatch -i dir1 -k 1 | tee /dev/stderr | sed -n 's/^Read up to //p'`
+touch dir1/c
+echo "Created 1 more file, consumer 1 only sees it"
+.././uWatch -i dir1 -q $POS1 -k 1
+echo "Consumer 2 has not read anything yet, sees all 3"
+POS2=`.././uWatch -i dir1 -k 2 | tee /dev/stderr | sed -n 's/^Read up to //p'`
+echo "Consumer 2 moves past them: what both have read is freed"
+.././uWatch -i dir1 -q $POS2 -k 2
+.././uWatch -n dir1
+echo "A file changing again comes back after the position read up to"
+echo "hello" >> dir1/a
+.././uWatch -i dir1 -q $POS2
+.././uWatch -u dir1 -k 1
+.././uWatch -u dir1 -k 2
+rmmod kWatch.ko
+rm -Rf dir1
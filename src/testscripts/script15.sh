@@ -0,0 +1,27 @@
+#Test for filtering the changes listed in the kernel
+#cleanup pre existing folders
+rm -Rf dir1
+mkdir dir1
+rmmod kWatch
+dd if=/dev/zero of=dir1/big bs=1M count=4 2>/dev/null
+touch dir1/owned dir1/small
+insmod ../kWatch.ko
+.././uWatch -s dir1
+echo "Set watch on dir1: SUCCESSFULLY"
+mkdir dir1/sub
+chown nobody dir1/owned
+chmod 600 dir1/owned
+echo "hello" >> dir1/small
+dd if=/dev/zero of=dir1/big bs=1M count=1 seek=1 conv=notrunc 2>/dev/null
+echo "Made a directory, changed the owner and mode of a file, appended"
+echo "to a small file and wrote 1MB in a big one"
+echo "Only the owner or mode changes:"
+.././uWatch -g dir1 -M owner,mode
+echo "Only the directories:"
+.././uWatch -g dir1 -T d
+echo "Only the files with at least 16 chunks changed:"
+.././uWatch -g dir1 -C 16
+echo "Only the regular files modified or created:"
+.././uWatch -g dir1 -M modify,create -T f
+rmmod kWatch.ko
+rm -Rf dir1
@@ -0,0 +1,19 @@
+#Test for the packed records of getWatch and their chunk ranges
+#cleanup pre existing folders
+rm -Rf dir1
+mkdir dir1
+rmmod kWatch
+dd if=/dev/zero of=dir1/big bs=1M count=8 2>/dev/null
+insmod ../kWatch.ko
+.././uWatch -s dir1
+echo "Set watch on dir1 with 16KB chunks: SUCCESSFULLY"
+dd if=/dev/zero of=dir1/big bs=16K count=1 conv=notrunc 2>/dev/null
+dd if=/dev/zero of=dir1/big bs=1M count=1 seek=1 conv=notrunc 2>/dev/null
+echo "hello" >> dir1/big
+echo "Wrote chunk 0, chunks 64 to 127 and appended to the file"
+echo "Expecting 0:64-127: then the chunk of the end of the file:"
+.././uWatch -g dir1
+echo "The same ranges in bytes:"
+.././uWatch -e dir1/big
+rmmod kWatch.ko
+rm -Rf dir1
@@ -0,0 +1,20 @@
+#Test for getting the handles and paths of the changed files
+#cleanup pre existing folders
+rm -Rf dir1
+mkdir -p dir1/sub/deep
+rmmod kWatch
+insmod ../kWatch.ko
+.././uWatch -s dir1
+echo "Set watch on dir1: SUCCESSFULLY"
+echo "hello" > dir1/top
+echo "hello" > dir1/sub/deep/file
+echo "hello" > dir1/gone
+rm dir1/gone
+echo "Wrote dir1/top and dir1/sub/deep/file, created and deleted"
+echo "dir1/gone, which has no path nor handle left"
+echo "Paths under dir1:"
+.././uWatch -g dir1 -P
+echo "Handles and paths of the regular files:"
+.././uWatch -g dir1 -T f -H -P
+rmmod kWatch.ko
+rm -Rf dir1
@@ -0,0 +1,37 @@
+#Test for reading changes off the ring of /dev/kwatch
+#cleanup pre existing folders
+rm -Rf dir1
+mkdir dir1
+rmmod kWatch
+insmod ../kWatch.ko
+.././uWatch -s dir1
+echo "Set watch on dir1: SUCCESSFULLY"
+.././uWatch -w dir1 > follow.log &
+FOLLOW=$!
+sleep 1
+echo "hello" > dir1/a
+echo "hello" > dir1/b
+sleep 1
+kill $FOLLOW
+wait $FOLLOW 2>/dev/null
+#the header page is mapped alone first, then the whole ring
+if grep -q "^Following" follow.log
+then
+	echo "Mapped the ring: SUCCESSFULLY"
+else
+	echo "Mapped the ring: FAILED"
+fi
+for f in a b
+do
+	INO=`ls -i dir1/$f | cut -d ' ' -f 1`
+	if grep -q "^$INO	" follow.log
+	then
+		echo "Read the changes of dir1/$f off the ring: SUCCESSFULLY"
+	else
+		echo "Read the changes of dir1/$f off the ring: FAILED"
+	fi
+done
+cat follow.log
+rm -f follow.log
+rmmod kWatch.ko
+rm -Rf dir1
@@ -0,0 +1,15 @@
+#Test for the feed calls of libkwatch
+#cleanup pre existing folders
+rm -Rf dir1
+mkdir dir1
+rmmod kWatch
+touch dir1/a dir1/b dir1/c dir1/d dir1/e dir1/f
+insmod ../kWatch.ko
+.././uWatch -s dir1
+echo "Set watch on dir1: SUCCESSFULLY"
+#opens the feed, chmods the files, then waits for their changes
+./feedTest -d dir1 dir1/a dir1/b dir1/c
+#poll stays quiet with 2 changes waiting, and wakes up at the 3rd
+./feedTest -d dir1 -t 3 dir1/d dir1/e dir1/f
+rmmod kWatch.ko
+rm -Rf dir1
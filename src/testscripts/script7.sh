@@ -0,0 +1,23 @@
+#Measure the cost kWatch adds to write() calls
+#Usage: ./script7.sh [num-of-writes]
+NUM=${1:-1000000}
+#cleanup pre existing folders
+rm -Rf dir1
+rm -Rf bench_dir
+mkdir dir1
+mkdir bench_dir
+rmmod kWatch
+echo "Without kWatch"
+./writeBench -n $NUM -f bench_dir/file
+insmod ../kWatch.ko
+.././uWatch -s dir1
+echo "With kWatch, writing outside of the watch"
+./writeBench -n $NUM -f bench_dir/file
+echo "With kWatch, writing inside the watch"
+echo 1 > /sys/kernel/debug/kwatch/enable
+./writeBench -n $NUM -f dir1/file
+echo 0 > /sys/kernel/debug/kwatch/enable
+cat /sys/kernel/debug/kwatch/stats
+rmmod kWatch.ko
+rm -Rf dir1
+rm -Rf bench_dir
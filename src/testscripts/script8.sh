@@ -0,0 +1,29 @@
+#Test for tracking the changed ranges of a large sparse file
+#cleanup pre existing folders
+rm -Rf dir1
+rm -Rf dir2
+mkdir dir1
+mkdir dir2
+rmmod kWatch
+insmod ../kWatch.ko
+.././uWatch -s dir1
+.././uWatch -s dir2 -b 1048576
+echo "Created 2 directories and set watch on them, dir2 with 1MB chunks: SUCCESSFULLY"
+.././uWatch -l
+#write a few blocks far apart in a 4GB file
+dd if=/dev/zero of=dir1/bigfile bs=4096 count=1 conv=notrunc 2>/dev/null
+dd if=/dev/zero of=dir1/bigfile bs=4096 count=1 seek=262144 conv=notrunc 2>/dev/null
+dd if=/dev/zero of=dir1/bigfile bs=4096 count=8 seek=1048575 conv=notrunc 2>/dev/null
+cp --sparse=always dir1/bigfile dir2/bigfile
+echo "Wrote at 0, 1GB and 4GB"
+.././uWatch -g dir1
+.././uWatch -e dir1/bigfile
+.././uWatch -e dir2/bigfile
+grep . /proc/kwatch/*
+#now cut it at 2GB
+truncate -s 2G dir1/bigfile
+echo "Truncated to 2GB"
+.././uWatch -e dir1/bigfile
+rmmod kWatch.ko
+rm -Rf dir1
+rm -Rf dir2
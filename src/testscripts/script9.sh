@@ -0,0 +1,28 @@
+#Test for the write paths other than write(): append, fallocate and copy_file_range
+#cleanup pre existing folders
+rm -Rf dir1
+mkdir dir1
+rmmod kWatch
+insmod ../kWatch.ko
+.././uWatch -s dir1
+echo "Created a directory and set watch on it: SUCCESSFULLY"
+dd if=/dev/zero of=dir1/file bs=1M count=4 2>/dev/null
+.././uWatch -f dir1
+#appends land at the end of the file, whatever its position
+echo "appended" >> dir1/file
+echo "Appended to a 4MB file"
+.././uWatch -e dir1/file
+.././uWatch -f dir1
+#fallocate: punch a hole, zero a range, grow the file
+fallocate -p -o 65536 -l 65536 dir1/file
+fallocate -z -o 1048576 -l 16384 dir1/file
+fallocate -o 8388608 -l 16384 dir1/file
+echo "Punched 64K at 64K, zeroed 16K at 1MB, allocated 16K at 8MB"
+.././uWatch -e dir1/file
+.././uWatch -f dir1
+#recent cp uses copy_file_range, which never calls write()
+cp dir1/file dir1/copy
+echo "Copied the file"
+.././uWatch -e dir1/copy
+rmmod kWatch.ko
+rm -Rf dir1
@@ -0,0 +1,149 @@
+/*
+ * @file:			writeBench.c
+ *
+ * @Description:	Micro benchmark for the cost kWatch adds to write()
+ *			calls which are not under any watch. Times NUM
+ *			writes of SIZE bytes to:
+ *			1. a regular file
+ *			2. /dev/null
+ *			and prints the cost of one call in nanoseconds.
+ *			Run it without kWatch, then with kWatch inserted
+ *			and a watch set elsewhere, and compare
+ *
+ * @author:		Himanshu Jindal, Piyush Kansal
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+
+/*
+ * Function to denote the usage of this program
+ */
+void usage(char *prg)
+{
+	printf("Usage: %s -f FILE [-n NUM] [-s SIZE]", prg);
+	printf("\n\t-f ARG: regular file to write to. It is truncated"
+			" first and removed at the end"
+			"\n\t-n ARG: number of writes, default 1000000"
+			"\n\t-s ARG: bytes per write, default 64\n");
+}
+
+/*
+ * Current time in nanoseconds
+ */
+long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Write num times size bytes to fd
+ * Returns the average cost of one write() in nanoseconds
+ */
+double time_writes(int fd, char *buf, int size, long num)
+{
+	long long start, end;
+	long i;
+
+	start = now_ns();
+	for (i = 0; i < num; i++) {
+		if (write(fd, buf, size) != size) {
+			perror("write");
+			return -1;
+		}
+	}
+	end = now_ns();
+
+	return (double)(end - start) / num;
+}
+
+int main(int argc, char **argv)
+{
+	char *file = NULL;
+	char *buf = NULL;
+	long num = 1000000;
+	int size = 64;
+	int fd;
+	int opt;
+	double cost;
+
+	while ((opt = getopt(argc, argv, "f:n:s:h")) != -1) {
+		switch (opt) {
+		case 'f':
+			file = optarg;
+			break;
+
+		case 'n':
+			num = atol(optarg);
+			break;
+
+		case 's':
+			size = atoi(optarg);
+			break;
+
+		case 'h':
+		default:
+			usage(argv[0]);
+			exit(0);
+		}
+	}
+
+	if (NULL == file || num <= 0 || size <= 0) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	buf = malloc(size);
+	if (NULL == buf) {
+		perror("malloc");
+		return -1;
+	}
+
+	memset(buf, 'k', size);
+
+	fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror("open");
+		return -1;
+	}
+
+	cost = time_writes(fd, buf, size, num);
+	close(fd);
+	unlink(file);
+	if (cost < 0) {
+		return -1;
+	}
+
+	printf("regular file\t%ld writes of %d bytes\t%.1f ns/write\n",
+		num, size, cost);
+
+	fd = open("/dev/null", O_WRONLY);
+	if (fd < 0) {
+		perror("open");
+		return -1;
+	}
+
+	cost = time_writes(fd, buf, size, num);
+	close(fd);
+	if (cost < 0) {
+		return -1;
+	}
+
+	printf("/dev/null\t%ld writes of %d bytes\t%.1f ns/write\n",
+		num, size, cost);
+
+	free(buf);
+	buf = NULL;
+
+	return 0;
+}
@@ -8,6 +8,13 @@
  *			4. flush out the info about latest modified
  *				files
  *			5. get watched directories
+ *			6. get changed byte ranges of a file
+ *			7. follow the changes of a watch through
+ *				/dev/kwatch
+ *			8. get and reset the changes of a watch
+ *				atomically
+ *			9. get the changes of a watch since an earlier
+ *				read, for one of several consumers
  *
  * @author:		Himanshu Jindal, Piyush Kansal
  */
@@ -22,41 +29,10 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
-#include <fcntl.h>
-#include <sys/mman.h>
+#include <errno.h>
 
 
-/*
- * Include necessary constant variables
- */
-#define _SET_WATCH_				0
-#define _REM_WATCH_				1
-#define _NUM_CHANGES_			2
-#define _NUM_WATCH_				3
-#define _FLUSH_WATCH_			4
-
-
-/*
- * Change Type
- */
-#define _FILE_MODIFY_BIT_		0
-#define _FILE_RENAME_BIT_		1
-#define _FILE_DELETE_BIT_		2
-#define _FILE_CREATE_BIT_		3
-#define _FILE_OWNER_BIT_		4
-#define _FILE_MODE_BIT_			5
-#define _FILE_TIME_BIT_			6
-#define _FILE_MMAP_BIT			7
-#define _CHANGE_MIN_			8
-#define _CHANGE_MAX_			126
-#define _FILE_REST_				127
-#define _CHANGE_OFFSET_			8
-
-
-/*
- * Constant for getting watched directories list
- */
-#define _DIR_LIST_				"@#"
+#include "libkwatch.h"
 
 
 /*
@@ -65,29 +41,285 @@
 void usage(char *prg)
 {
 	printf("Usage: %s [Option]", prg);
-	printf("\n\t-s ARG: set watch point. ARG denotes the watch-point"
+	printf("\n\t-s ARG [-b SIZE]: set watch point. ARG denotes the"
+				" watch-point"
+			"\n\t\tSIZE: chunk size in bytes, a power of 2"
+				" from 512 to 1G"
 			"\n\t-r ARG: remove watch point. ARG denotes the"
 				" watch-point"
 			"\n\t-n ARG: get count of latest added/modified"
-				" files under a watch point."
+				" files under a watch point, and tell if"
+				" changes were lost."
 				"ARG denotes the watch-point"
 			"\n\t-f ARG: flush the changes for a watch point."
 				" ARG denotes the watch-point"
-			"\n\t-g ARG: get modified files under a watch point."
+			"\n\t-g ARG [FILTER]: get modified files under a"
+				" watch point. ARG denotes the watch-point"
+			"\n\t-x ARG: get modified files under a watch point"
+				" and flush it, losing nothing in between."
 				" ARG denotes the watch-point"
+			"\n\t-a ARG: register a consumer of a watch point,"
+				" and print its id. ARG denotes the"
+				" watch-point"
+			"\n\t-u ARG -k ID: unregister consumer ID of a watch"
+				" point. ARG denotes the watch-point"
+			"\n\t-i ARG [-q EPOCH:SEQ] [-k ID] [FILTER]: get files"
+				" modified"
+				" under a watch point since an earlier -i,"
+				" which printed EPOCH:SEQ. With the id of a"
+				" consumer, what all consumers have read is"
+				" freed. ARG denotes the watch-point"
+			"\n\t-e ARG: get changed byte ranges of a file"
+				" under a watch point. ARG denotes the file"
+			"\n\t-w ARG [-t COUNT]: follow the changes under a"
+				" watch point as they happen. ARG denotes the"
+				" watch-point"
+			"\n\t\tCOUNT: wake up once that many changes"
+				" are waiting, 1 by default"
+			"\n\tFILTER, for -g and -i, lists only the files"
+				" matching all of:"
+			"\n\t\t-M CHANGES: a comma separated list of modify,"
+				" rename, delete, create, owner, mode, time,"
+				" mmap, any of which has to be set"
+			"\n\t\t-C COUNT: at least COUNT chunks changed"
+			"\n\t\t-T TYPE: f for files, d for directories, l for"
+				" symbolic links"
+			"\n\t\tand may print for each of them:"
+			"\n\t\t-H: a handle for open_by_handle_at(), as"
+				" TYPE:BYTES in hex"
+			"\n\t\t-P: its path under the watch-point"
 			"\n\t-c: get the count of folders being watched"
 			"\n\t-l: get the list of folders being watched\n");
 }
 
-struct data_node {
-	unsigned long inode;
-	int bMap[4];
-	struct data_node *next;
-};
+/*
+ * Names of the change types, in the order of their bits
+ */
+const char *change_names[] = {"modify", "rename", "delete", "create",
+				"owner", "mode", "time", "mmap"};
+
+/*
+ * Print a changed file and the types of its changes
+ */
+void print_change(unsigned long long ino, unsigned int bits)
+{
+	int j;
+
+	printf("%llu\t", ino);
+
+	for (j = 0; j < _CHANGE_MIN_; j++) {
+		if (!(bits & (1U << j))) {
+			continue;
+		}
+
+		switch (j) {
+		case _FILE_MODIFY_BIT_:
+			printf(" Modified ");
+			break;
+
+		case _FILE_RENAME_BIT_:
+			printf(" Renamed ");
+			break;
+
+		case _FILE_DELETE_BIT_:
+			printf(" Deleted ");
+			break;
+
+		case _FILE_CREATE_BIT_:
+			printf(" Created ");
+			break;
+
+		case _FILE_OWNER_BIT_:
+			printf(" Owner_Changed ");
+			break;
+
+		case _FILE_MODE_BIT_:
+			printf(" Mode_Changed ");
+			break;
+
+		case _FILE_TIME_BIT_:
+			printf(" AccessTime_Changed ");
+			break;
+
+		case _FILE_MMAP_BIT:
+			printf(" Change_via_Mmap ");
+			break;
+		}
+	}
+}
+
+/*
+ * Print a changed file: its types of change and changed chunks, as
+ * first-last, or first- for a range up to the end of the file, then its
+ * handle, as type:hex bytes, and path if they were asked for
+ */
+void print_file(struct kwatch_change *change, unsigned int flags)
+{
+	struct kwatch_range *range;
+	unsigned int i;
+
+	print_change(change->ino, change->kinds);
+
+	for (i = 0; i < change->num_ranges; i++) {
+		range = &change->range[i];
+		if (0 == range->count) {
+			printf("%llu-:", range->first);
+		} else if (1 == range->count) {
+			printf("%llu:", range->first);
+		} else {
+			printf("%llu-%llu:", range->first,
+				range->first + range->count - 1);
+		}
+	}
+
+	if (flags & _QUERY_HANDLE_) {
+		printf("\thandle %u:", change->handle_type);
+		for (i = 0; i < change->handle_bytes; i++) {
+			printf("%02x", change->handle[i]);
+		}
+	}
+
+	if (flags & _QUERY_PATH_) {
+		printf("\t%.*s", (int) change->path_len, change->path);
+	}
+
+	printf("\n");
+}
+
+/*
+ * Fill the filter of a query from an option, -M, -C or -T, or ask for
+ * the handles or paths of the files, -H or -P
+ * Returns -1 if the option is not one of those, or is invalid
+ */
+int parse_filter(int opt, char *arg, struct user_query *query)
+{
+	char *name;
+	int bit;
+
+	switch (opt) {
+	case 'M':
+		for (name = strtok(arg, ","); name != NULL;
+				name = strtok(NULL, ",")) {
+			for (bit = 0; bit < _CHANGE_MIN_; bit++) {
+				if (0 == strcmp(name, change_names[bit])) {
+					break;
+				}
+			}
+
+			if (bit == _CHANGE_MIN_) {
+				return -1;
+			}
+
+			query->mask |= 1U << bit;
+		}
+		return 0;
+
+	case 'C':
+		query->min_chunks = strtoul(arg, NULL, 0);
+		return 0;
+
+	case 'T':
+		if (0 == strcmp(arg, "f")) {
+			query->type = S_IFREG;
+		} else if (0 == strcmp(arg, "d")) {
+			query->type = S_IFDIR;
+		} else if (0 == strcmp(arg, "l")) {
+			query->type = S_IFLNK;
+		} else {
+			return -1;
+		}
+		return 0;
+
+	case 'H':
+		query->flags |= _QUERY_HANDLE_;
+		return 0;
+
+	case 'P':
+		query->flags |= _QUERY_PATH_;
+		return 0;
+	}
+
+	return -1;
+}
+
+/*
+ * Print the changes recorded under a watch, a page at a time until the
+ * cursor says we are done. The query passed gives what to read: the
+ * flags, position, consumer and filter, see struct user_query
+ */
+int list_changes(char *dirname, struct user_query *init)
+{
+	int ret = 0;
+	struct kwatch_iter iter;
+	struct kwatch_change change;
+
+	if (kwatch_iter_init(&iter, dirname, init, NULL, 0) < 0) {
+		perror("malloc");
+		exit(1);
+	}
+
+	printf("Following files modified under watch of %s\n", dirname);
+	printf("Inodeno\tInterpretation of the BitMap, changed chunks\n");
+
+	while ((ret = kwatch_iter_next(&iter, &change)) > 0) {
+		print_file(&change, iter.query->flags);
+	}
+
+	if (ret < 0 && ESTALE == errno) {
+		printf("%s was flushed, read it again from the start\n",
+			dirname);
+	}
+
+	if (ret >= 0 && (iter.query->flags & _QUERY_RESCAN_)) {
+		printf("Changes were lost in %s, the list above is"
+			" not complete: rescan it\n", dirname);
+	}
+
+	if (ret >= 0) {
+		printf("Read up to %u:%llu\n", iter.query->epoch,
+			iter.query->seq);
+	}
+
+	kwatch_iter_end(&iter);
+
+	return ret;
+}
 
-int check_bit(int *bMap, int position)
+/*
+ * Print the changes of a watch as the kernel publishes them to the
+ * ring of the feed. Only a drop makes us look at anything else
+ * We sleep in poll() until threshold changes are waiting
+ */
+int follow_watch(char *dirname, unsigned int threshold)
 {
-	return bMap[position/32] & (1 << (position%32));
+	struct kwatch_feed feed;
+	const struct feed_rec *rec;
+
+	if (kwatch_feed_open(&feed, dirname, threshold) < 0) {
+		return -1;
+	}
+
+	printf("Following changes under watch of %s\n", dirname);
+	printf("Inodeno\tInterpretation of the BitMap\n");
+	fflush(stdout);
+
+	while (kwatch_feed_wait(&feed, -1) >= 0) {
+		while ((rec = kwatch_feed_next(&feed)) != NULL) {
+			print_change(rec->ino,
+				rec->bits & ((1 << _CHANGE_MIN_) - 1));
+			printf("\n");
+		}
+
+		if (kwatch_feed_dropped(&feed)) {
+			printf("Fell behind, some changes were not followed:"
+				" see \"-g %s\"\n", dirname);
+		}
+		fflush(stdout);
+	}
+
+	kwatch_feed_close(&feed);
+
+	return -1;
 }
 
 /*
@@ -97,18 +329,19 @@ int check_bit(int *bMap, int position)
 int main(int argc, char **argv)
 {
 	int ret;
-	void *buf = NULL;
-	struct data_node *temp = NULL;
-	struct data_node *temp_node = NULL;
-	int len;
 	int i;
-	unsigned long inode_num = 0;
-	int j;
+	struct user_extent ext[_MAX_EXTENTS_];
+	struct user_watch *watch = NULL;
+	unsigned long block_size = 0;
+	unsigned int threshold;
+	unsigned int consumer;
+	struct user_query filter;
+	char *dirname = NULL;
 
 	/*
 	 * Scan i/p parameters from command line
 	 */
-	switch (getopt(argc, argv, "s:r:n:f:g:cl")) {
+	switch (getopt(argc, argv, "s:r:n:f:g:x:a:u:i:e:w:cl")) {
 	case 's':
 		if (NULL == optarg) {
 			printf("Missing argument for \"-s\"");
@@ -116,9 +349,19 @@ int main(int argc, char **argv)
 			exit(1);
 		}
 
-		ret = syscall(349, optarg, _SET_WATCH_);
+		dirname = optarg;
+		if ('b' == getopt(argc, argv, "b:")) {
+			block_size = strtoul(optarg, NULL, 0);
+			if (kwatch_chunk_bits(block_size) < 0) {
+				printf("Invalid chunk size \"%s\"", optarg);
+				usage(argv[0]);
+				exit(1);
+			}
+		}
+
+		ret = kwatch_set(dirname, block_size);
 		if (ret > 0) {
-			printf("watch set on %s\n", optarg);
+			printf("watch set on %s\n", dirname);
 		}
 		break;
 
@@ -129,7 +372,7 @@ int main(int argc, char **argv)
 			exit(1);
 		}
 
-		ret = syscall(349, optarg, _REM_WATCH_);
+		ret = kwatch_remove(optarg);
 		if (ret > 0) {
 			printf("watch removed from %s\n", optarg);
 		}
@@ -142,10 +385,15 @@ int main(int argc, char **argv)
 			exit(1);
 		}
 
-		ret = syscall(349, optarg, _NUM_CHANGES_);
+		ret = kwatch_num_changes(optarg);
 		if (ret >= 0) {
 			printf("Number of changes :%d in %s\n", ret, optarg);
 		}
+
+		if (kwatch_needs_rescan(optarg) > 0) {
+			printf("Changes were lost in %s, rescan it before"
+				" flushing\n", optarg);
+		}
 		break;
 
 	case 'f':
@@ -155,7 +403,7 @@ int main(int argc, char **argv)
 			exit(1);
 		}
 
-		ret = syscall(349, optarg, _FLUSH_WATCH_);
+		ret = kwatch_flush(optarg);
 		if (ret > 0) {
 			printf("Watch flushed:%s\n", optarg);
 		}
@@ -168,83 +416,153 @@ int main(int argc, char **argv)
 			exit(1);
 		}
 
-		ret = syscall(349, optarg, _NUM_CHANGES_);
+		dirname = optarg;
+		memset(&filter, 0, sizeof(struct user_query));
+		while ((i = getopt(argc, argv, "M:C:T:HP")) != -1) {
+			if (parse_filter(i, optarg, &filter) < 0) {
+				usage(argv[0]);
+				exit(1);
+			}
+		}
 
-		if (0 == ret) {
+		/* Nothing recorded, or not a watch */
+		if (kwatch_num_changes(dirname) <= 0) {
+			ret = 0;
 			break;
 		}
 
-		len = ret * sizeof(struct data_node);
-		buf = malloc(len);
-		ret = syscall(350, optarg, buf, len);
-		printf("Following files modified under watch of %s\n", optarg);
-		printf("Inodeno\tInterpretation of the BitMap\n");
-		temp = (struct data_node *) buf;
-		for (i = 0; i < ret; i++) {
-			temp_node = (temp+i);
-			inode_num = temp_node->inode;
-
-			if (inode_num != 0) {
-				printf("%lu\t", inode_num);
-
-				for (j = 0; j < sizeof(int)*4*8; j++) {
-					if (check_bit(temp_node->bMap, j)) {
-					switch (j) {
-					case _FILE_MODIFY_BIT_:
-						printf(" Modified ");
-						break;
-
-					case _FILE_RENAME_BIT_:
-						printf(" Renamed ");
-						break;
-
-					case _FILE_DELETE_BIT_:
-						printf(" Deleted ");
-						break;
-
-					case _FILE_CREATE_BIT_:
-						printf(" Created ");
-						break;
-
-					case _FILE_OWNER_BIT_:
-						printf(" Owner_Changed ");
-						break;
-
-					case _FILE_MODE_BIT_:
-						printf(" Mode_Changed ");
-						break;
-
-					case _FILE_TIME_BIT_:
-						printf(" AccessTime_Changed ");
-						break;
-
-					case _FILE_MMAP_BIT:
-						printf(" Change_via_Mmap ");
-						break;
-
-					case _FILE_REST_:
-						printf(" >119_chunk_changed ");
-						break;
-
-					default:
-						printf("%d:", j-8);
-						break;
-					}
-					}
+		ret = list_changes(dirname, &filter);
+		break;
+
+	case 'x':
+		if (NULL == optarg) {
+			printf("Missing argument for \"-x\"");
+			usage(argv[0]);
+			exit(1);
+		}
+
+		/* Nothing recorded, or not a watch */
+		ret = kwatch_snapshot(optarg);
+		if (ret <= 0) {
+			break;
+		}
+
+		memset(&filter, 0, sizeof(struct user_query));
+		filter.flags = _QUERY_SNAPSHOT_;
+		ret = list_changes(optarg, &filter);
+		break;
+
+	case 'a':
+		if (NULL == optarg) {
+			printf("Missing argument for \"-a\"");
+			usage(argv[0]);
+			exit(1);
+		}
+
+		ret = kwatch_add_consumer(optarg);
+		if (ret > 0) {
+			printf("Consumer %d registered on %s\n", ret, optarg);
+		}
+		break;
+
+	case 'u':
+		if (NULL == optarg) {
+			printf("Missing argument for \"-u\"");
+			usage(argv[0]);
+			exit(1);
+		}
+
+		dirname = optarg;
+		if ('k' != getopt(argc, argv, "k:")) {
+			printf("Missing consumer id for \"-u\"");
+			usage(argv[0]);
+			exit(1);
+		}
+
+		consumer = strtoul(optarg, NULL, 0);
+		ret = kwatch_remove_consumer(dirname, consumer);
+		if (ret > 0) {
+			printf("Consumer %u unregistered from %s\n", consumer,
+				dirname);
+		}
+		break;
+
+	case 'i':
+		if (NULL == optarg) {
+			printf("Missing argument for \"-i\"");
+			usage(argv[0]);
+			exit(1);
+		}
+
+		dirname = optarg;
+		memset(&filter, 0, sizeof(struct user_query));
+		while ((i = getopt(argc, argv, "q:k:M:C:T:HP")) != -1) {
+			if ('q' == i) {
+				if (sscanf(optarg, "%u:%llu", &filter.epoch,
+						&filter.since) != 2) {
+					printf("Invalid position \"%s\"",
+						optarg);
+					usage(argv[0]);
+					exit(1);
 				}
+			} else if ('k' == i) {
+				filter.consumer = strtoul(optarg, NULL, 0);
+			} else if (parse_filter(i, optarg, &filter) < 0) {
+				usage(argv[0]);
+				exit(1);
+			}
+		}
+
+		ret = list_changes(dirname, &filter);
+		break;
 
-				printf("\n");
+	case 'e':
+		if (NULL == optarg) {
+			printf("Missing argument for \"-e\"");
+			usage(argv[0]);
+			exit(1);
+		}
+
+		ret = kwatch_extents(optarg, ext, _MAX_EXTENTS_);
+		if (ret < 0) {
+			break;
+		}
+
+		printf("Following byte ranges of %s changed\n", optarg);
+		printf("Offset\tLength\n");
+		for (i = 0; i < ret; i++) {
+			if (ext[i].length == ~0ULL) {
+				printf("%llu\tto_end_of_file\n", ext[i].offset);
+			} else {
+				printf("%llu\t%llu\n", ext[i].offset,
+					ext[i].length);
 			}
 		}
+		break;
+
+	case 'w':
+		if (NULL == optarg) {
+			printf("Missing argument for \"-w\"");
+			usage(argv[0]);
+			exit(1);
+		}
 
-		if (buf) {
-			free(buf);
-			buf = NULL;
+		dirname = optarg;
+		threshold = 1;
+		if ('t' == getopt(argc, argv, "t:")) {
+			threshold = strtoul(optarg, NULL, 0);
+			if (0 == threshold) {
+				printf("Invalid count \"%s\"", optarg);
+				usage(argv[0]);
+				exit(1);
+			}
 		}
+
+		ret = follow_watch(dirname, threshold);
 		break;
 
 	case 'c':
-		ret = syscall(349, NULL, _NUM_WATCH_);
+		ret = kwatch_num_watches();
 		if (ret >= 0) {
 			printf("Number of folders "
 				"being watched :: %d\n", ret);
@@ -253,19 +571,19 @@ int main(int argc, char **argv)
 		break;
 
 	case 'l':
-		ret = syscall(349, NULL, _NUM_WATCH_);
+		ret = kwatch_num_watches();
 
 		if (0 == ret) {
 			break;
 		}
 
-		len = ret * sizeof(unsigned long);
-		buf = malloc(len);
-		ret = syscall(350, _DIR_LIST_, buf, len);
+		watch = malloc(ret * sizeof(struct user_watch));
+		ret = kwatch_list_watches(watch, ret);
 		printf("Following directories ""under watch\n");
 		for (i = 0; i < ret; i++) {
 			printf("Directory %d :: "
-			"%lu\n", i+1, *((unsigned long *)buf + i));
+			"%lu chunk size %lu\n", i+1, watch[i].inode,
+			watch[i].block_size);
 		}
 
 		break;